@@ -13,6 +13,8 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include "small_primes.h"
+
 template<typename T>
 class _DisplayType;
 
@@ -51,7 +53,9 @@ struct BitMask<head> {
 
 #define BM(bits...) (BitMask<bits>::v)
 
-bool notPrime[P];
+// Sieved at compile time into read-only data.
+constexpr const auto& primeTable = kSmallPrimeSieve<P>;
+static_assert(primeTable.count() == 78'498);
 int bitMaskToEdgeCnt[BT(W)][W][W];
 
 using IntPair = std::pair<int, int>;
@@ -80,14 +84,6 @@ int numToBitMask(int num, std::vector<IntPair>& ip) {
 
 void initPrimeNumberTable(int d) {
   LOG(INFO) << "Initing the prime number table.";
-  for (int p = 2; p * p < P; ++p) {
-    if (notPrime[p]) {
-      continue;
-    }
-    for (int n = p * p; n < P; n += p) {
-      notPrime[n] = true;
-    }
-  }
   memset(bitMaskToEdgeCnt, 0, sizeof bitMaskToEdgeCnt);
 
   int primeCnt = 0;
@@ -97,7 +93,7 @@ void initPrimeNumberTable(int d) {
     wd *= W;
   }
   for (int p = wd / W; p < wd; ++p) {
-    if (notPrime[p]) {
+    if (!primeTable.isPrime(p)) {
       continue;
     }
     std::vector<IntPair> ip;
@@ -210,7 +206,7 @@ TEST(ScoringTest, Basic) {
             BM(4, 7, 3, 6, 2, 0, 1, 1));
 
   initPrimeNumberTable(5);
-  EXPECT_FALSE(notPrime[24103]);
+  EXPECT_TRUE(primeTable.isPrime(24103));
   std::vector<IntPair> ip;
   int bm = numToBitMask(24103, ip);
   EXPECT_EQ(BM(2, 4, 1, 0, 3), bm);
@@ -52,8 +52,13 @@ struct ColorCode<head> {
 
 #define CC(colors...) (ColorCode<colors>::v)
 
+#include "prime_list.h"
 #include "prime_number_gen.h"
 
+DEFINE_string(sieve_cache_dir, "",
+              "If set, load prime tables from this directory and save the "
+              "ones which are missing there.");
+
 constexpr int GRAY = 0;
 constexpr int YELLOW = 1;
 constexpr int GREEN = 2;
@@ -273,14 +278,15 @@ int main(int argc, char* argv[]) {
     return ret;
   }
 
-  PrimeNumberGen pg5(10'000, 100'000);
-  PrimeNumberGen pg7(1'000'000, 10'000'000);
+  auto pg5 = PrimeNumberGen::cached(FLAGS_sieve_cache_dir, 10'000, 100'000);
+  auto pg7 = PrimeNumberGen::cached(FLAGS_sieve_cache_dir, 1'000'000,
+                                    10'000'000, omp_get_max_threads());
 
   auto solver =[](const PrimeNumberGen& pg, int L) {
-    std::vector<int> rawPrimes;
+    const PrimeList rawPrimes(pg);
     std::vector<BinAndBM> primes;
-    for (auto p : pg) {
-      rawPrimes.push_back(p);
+    primes.reserve(rawPrimes.size());
+    for (auto p : rawPrimes) {
       primes.push_back(toBin(p, L));
     }
     // Pass in an env OMP_NUM_THREADS=8
@@ -316,7 +322,7 @@ int main(int argc, char* argv[]) {
     }
   };
 
-  solver(pg5, 5);
-  solver(pg7, 7);
+  solver(*pg5, 5);
+  solver(*pg7, 7);
   return 0;
 }
@@ -19,39 +19,23 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <omp.h>
 
+#include "prime_list.h"
 #include "prime_number_gen.h"
 #include <cmath>
 
+DEFINE_string(sieve_cache_dir, "",
+              "If set, load prime tables from this directory and save the "
+              "ones which are missing there.");
+DEFINE_bool(streaming, false,
+            "Solve with solveStreaming(), in memory independent of n, rather "
+            "than with solveParallel() on all OpenMP threads.");
+
 // Get the first n primes (3, 5, 7, 11, ...)
 std::vector<uint64_t> getFirstNOddPrimes(int n) {
-  std::vector<uint64_t> result;
-  result.reserve(n);
-
-  // The nth prime is approximately n * ln(n) for large n
-  uint64_t upperBound = std::max(static_cast<uint64_t>(100),
-                                 static_cast<uint64_t>(n * std::log(n) * 2));
-
-  PrimeNumberGen gen(3, upperBound);
-  for (uint64_t p : gen) {
-    result.push_back(p);
-    if (result.size() == static_cast<size_t>(n))
-      break;
-  }
-
-  // If we didn't get enough primes, increase the bound and try again
-  while (result.size() < static_cast<size_t>(n)) {
-    upperBound *= 2;
-    result.clear();
-    PrimeNumberGen gen2(3, upperBound);
-    for (uint64_t p : gen2) {
-      result.push_back(p);
-      if (result.size() == static_cast<size_t>(n))
-        break;
-    }
-  }
-
-  return result;
+  // One sieve sized by a proven upper bound for the n-th odd prime.
+  return firstKPrimes(n, 3, omp_get_max_threads());
 }
 
 // Get the first n positive even integers (2, 4, 6, ..., 2n)
@@ -71,23 +55,40 @@ uint64_t bruteForce(uint64_t n) {
   // Find the maximum possible sum to create prime sieve
   uint64_t maxSum = oddPrimes.back() + evenInts.back();
 
-  // Create prime sieve up to maxSum
-  PrimeNumberGen primeGen(2, maxSum + 1);
+  // Create prime sieve up to maxSum. The lookups below are scattered, so back
+  // it with huge pages to keep them off the TLB.
+  PrimeNumberGen primeGen(2, maxSum + 1, 1, SieveMemory{.hugePages = true});
 
-  // Count prime sums
+  // Count prime sums, one batch of n lookups per odd prime
   uint64_t count = 0;
+  std::vector<uint64_t> sums(n);
   for (uint64_t p : oddPrimes) {
-    for (uint64_t e : evenInts) {
-      uint64_t sum = p + e;
-      if (primeGen.isPrime(sum)) {
-        ++count;
-      }
+    for (int i = 0; i < n; ++i) {
+      sums[i] = p + evenInts[i];
     }
+    count += primeGen.isPrimeBatch(sums);
   }
 
   return count;
 }
 
+// f(n) by counting the sums per odd prime: p + 2, ..., p + 2n are exactly the
+// odd numbers in [p + 2, p + 2n], so the prime sums of p are the primes there,
+// counted with popcounts over the table words. O(n^2 / 240) word operations
+// and nothing shared with the solvers besides the sieve, so it can check them
+// for n in the millions.
+uint64_t popcountOracle(uint64_t n) {
+  const auto oddPrimes = getFirstNOddPrimes(n);
+  const PrimeNumberGen primeGen(3, oddPrimes.back() + n * 2,
+                                omp_get_max_threads());
+  uint64_t count = 0;
+#pragma omp parallel for schedule(static) reduction(+ : count)
+  for (uint64_t i = 0; i < n; ++i) {
+    count += primeGen.countInRange(oddPrimes[i] + 2, oddPrimes[i] + n * 2);
+  }
+  return count;
+}
+
 TEST(PuzzleTest, FirstOddPrimes) {
   auto primes = getFirstNOddPrimes(5);
   ASSERT_EQ(primes.size(), 5);
@@ -143,6 +144,13 @@ TEST(PuzzleTest, F4) {
   EXPECT_EQ(bruteForce(4), 11);
 }
 
+TEST(PuzzleTest, PopcountOracle) {
+  for (int n = 1; n <= 300; ++n) {
+    ASSERT_EQ(popcountOracle(n), bruteForce(n)) << n;
+  }
+  EXPECT_EQ(popcountOracle(9'100), bruteForce(9'100));
+}
+
 TEST(PuzzleTest, SmallValues) {
   // Print f(n) for small values to see the pattern
   for (int n = 1; n <= 10; ++n) {
@@ -151,26 +159,40 @@ TEST(PuzzleTest, SmallValues) {
   }
 }
 
+// One sieve from 3 covers both the first n odd primes and all the sums: the
+// n-th odd prime is at most nthPrimeUpperBound(n + 1).
+std::unique_ptr<PrimeNumberGen> sieveForSums(uint64_t n) {
+  return PrimeNumberGen::cached(FLAGS_sieve_cache_dir, 3,
+                                nthPrimeUpperBound(n + 1) + n * 2,
+                                omp_get_max_threads());
+}
+
 uint64_t solve(uint64_t n) {
-  // Get the first n odd primes to estimate the upper bound for the sieve
-  const auto smallPrimes = getFirstNOddPrimes(n);
+  const auto primeGen = sieveForSums(n);
   // The maximum possible sum we need to check is the largest prime + largest even number (2n)
-  uint64_t maxSum = smallPrimes.back() + n * 2;
-  
-  // Generate primes up to maxSum using the sieve
-  PrimeNumberGen primeGen(3, maxSum);
-  std::vector<uint64_t> primes;
-  for (uint64_t p : primeGen) {
+  uint64_t maxSum = primeGen->nthPrime(n) + n * 2;
+
+  // Gap-encoded, about one byte per prime; both cursors below only step forward.
+  PrimeList primes;
+  for (uint64_t p : *primeGen) {
+    if (p > maxSum) {
+      break;
+    }
     primes.push_back(p);
   }
-  LOG(INFO) << "There are " << primes.size() << " primes up to " << maxSum;
+  primes.shrinkToFit();
+  LOG(INFO) << "There are " << primes.size() << " primes up to " << maxSum
+            << " in " << primes.memoryBytes() << " bytes";
   
   uint64_t count = 0;
-  int l = 0; // Index in primes vector such that primes[i] - primes[l] <= 2n
+  int l = 0; // Index in primes such that primes[i] - primes[l] <= 2n
+  auto tail = primes.begin(); // primes[l]
+  auto head = primes.begin();
   
   // Iterate through all primes that could be a sum of an odd prime and an even number
-  for (int i = 1; i < primes.size(); ++i) {
-    auto p = primes[i];
+  for (++head; head != primes.end(); ++head) {
+    const int i = head.index();
+    auto p = *head;
     
     // We are looking for solutions to p = prime + even
     // where prime is the l-th odd prime (primes[l]) and even is 2*k (1 <= k <= n)
@@ -178,8 +200,9 @@ uint64_t solve(uint64_t n) {
     // This means we need primes[l] >= p - 2*n
     
     // Adjust l to satisfy the condition p - primes[l] <= 2n
-    while (l < n && p - primes[l] > n * 2) {
+    while (l < n && p - *tail > n * 2) {
       ++l;
+      ++tail;
     }
     
     // The number of valid pairs for this prime sum 'p' is the number of odd primes
@@ -197,7 +220,90 @@ uint64_t solve(uint64_t n) {
   return count;
 }
 
+// The same count as solve() without any table: a head cursor walks the
+// candidate sums p and a tail cursor the odd prime primes[l], each from its
+// own PrimeStream. Memory is two segments and the sieving primes up to
+// sqrt(maxSum), whatever n is. Once l reaches n, no later p can be the sum
+// of one of the first n odd primes and an even number up to 2n, so the head
+// stops there without knowing maxSum.
+uint64_t solveStreaming(uint64_t n) {
+  PrimeStream head(3), tail(3);
+  head.next();
+  uint64_t count = 0;
+  uint64_t l = 0; // The index of primes[l] == t.
+  uint64_t t = tail.next();
+  for (uint64_t i = 1;; ++i) {
+    const uint64_t p = head.next();
+    while (l < n && p - t > n * 2) {
+      ++l;
+      t = tail.next();
+    }
+    if (l == n) {
+      break;
+    }
+    count += std::min(n, i) - l;
+  }
+  return count;
+}
+
+// solve() split into value ranges of the sums p, counted on 'numThreads'.
+// The two-pointer state at the start of a range follows from the table's
+// rank index: i = pi(p - 1) primes come before p, and l counts the odd
+// primes below p - 2n, capped at n.
+uint64_t solveParallel(uint64_t n, int numThreads) {
+  const auto primeGen = sieveForSums(n);
+  const PrimeNumberGen& gen = *primeGen;
+  const uint64_t maxSum = gen.nthPrime(n) + n * 2;
+  // The odd primes in [3, x].
+  const auto primesUpTo = [&gen](uint64_t x) { return x < 3 ? 0 : gen.pi(x); };
+
+  // Ranges of equal width hold about equally many primes; several per
+  // thread even out the rest.
+  const uint64_t numChunks = std::min<uint64_t>(numThreads * 16, maxSum);
+  const uint64_t chunkWidth = (maxSum - 5) / numChunks + 1;
+  uint64_t count = 0;
+#pragma omp parallel for num_threads(numThreads) schedule(dynamic) \
+    reduction(+ : count)
+  for (uint64_t c = 0; c < numChunks; ++c) {
+    const uint64_t first = 5 + c * chunkWidth;
+    const uint64_t last = std::min(first + chunkWidth - 1, maxSum);
+    uint64_t i = primesUpTo(first - 1);
+    if (first > last || i >= primesUpTo(last)) {
+      continue;
+    }
+    PrimeNumberGen::Itr head{&gen, gen.nthPrime(i + 1)};
+    uint64_t l = std::min(n, *head > n * 2 + 3 ? primesUpTo(*head - n * 2 - 1)
+                                               : uint64_t(0));
+    if (l == n) {
+      continue; // No sum from here on counts.
+    }
+    PrimeNumberGen::Itr tail{&gen, gen.nthPrime(l + 1)};
+    for (; *head <= last; ++head, ++i) {
+      while (l < n && *head - *tail > n * 2) {
+        ++l;
+        ++tail;
+      }
+      if (l < std::min(n, i)) {
+        count += std::min(n, i) - l;
+      }
+    }
+  }
+  return count;
+}
+
 TEST(PuzzleTest, SolveF5) { EXPECT_EQ(solve(5), 16); }
+TEST(PuzzleTest, SolveParallel) {
+  for (uint64_t n : {1, 2, 3, 4, 5, 1'000, 8'100, 20'001, 1'000'000}) {
+    for (int numThreads : {1, 3, 8}) {
+      EXPECT_EQ(solveParallel(n, numThreads), solve(n)) << n << " " << numThreads;
+    }
+  }
+}
+TEST(PuzzleTest, SolveStreaming) {
+  for (uint64_t n : {1, 2, 3, 4, 5, 1'000, 8'100, 20'001, 1'000'000}) {
+    EXPECT_EQ(solveStreaming(n), solve(n)) << n;
+  }
+}
 
 TEST(PuzzleTest, SolveF1000) { EXPECT_EQ(solve(1'000), bruteForce(1'000)); }
 TEST(PuzzleTest, SolveF2000) { EXPECT_EQ(solve(2'000), bruteForce(2'000)); }
@@ -208,7 +314,11 @@ TEST(PuzzleTest, SolveF8100) { EXPECT_EQ(solve(8'100), bruteForce(8'100)); }
 TEST(PuzzleTest, SolveF9100) { EXPECT_EQ(solve(9'100), bruteForce(9'100)); }
 TEST(PuzzleTest, SolveF20001) { EXPECT_EQ(solve(20'001), bruteForce(20'001)); }
 TEST(PuzzleTest, SolveF200010) {
-  EXPECT_EQ(solve(200'010), bruteForce(200'010));
+  EXPECT_EQ(solve(200'010), popcountOracle(200'010));
+}
+TEST(PuzzleTest, SolveF2000000) {
+  EXPECT_EQ(solveParallel(2'000'000, omp_get_max_threads()),
+            popcountOracle(2'000'000));
 }
 
 int main(int argc, char** argv) {
@@ -221,7 +331,12 @@ int main(int argc, char** argv) {
   if (argc <= 1 || std::string(argv[1]) != "solve") {
     return res;
   }
-  std::cout << solve(100'000'000) << std::endl;
-  std::cout << solve(1'000'000'000) << std::endl;
+  const auto solver = FLAGS_streaming
+                          ? solveStreaming
+                          : [](uint64_t n) {
+                              return solveParallel(n, omp_get_max_threads());
+                            };
+  std::cout << solver(100'000'000) << std::endl;
+  std::cout << solver(1'000'000'000) << std::endl;
   return res;
 }
@@ -15,8 +15,10 @@ A bonus "*" will be given for finding the sum of all the natural numbers x such
 */
 
 #include <algorithm>
+#include <array>
 #include <cstdint>
 #include <iostream>
+#include <string>
 #include <vector>
 #include <unordered_set>
 #include <thread>
@@ -29,6 +31,11 @@ A bonus "*" will be given for finding the sum of all the natural numbers x such
 using Nat = uint64_t;
 
 // Return true if f returns true for any value
+//
+// The splits are visited in Gray code order, so consecutive splits differ in
+// a single gap between two digits. Flipping that gap merges or splits the
+// two parts around it, which updates the total in O(1) from the values of
+// all digit segments computed up front.
 template <typename F>
 bool genAn(Nat n, F f) {
   int digits[20];
@@ -40,20 +47,37 @@ bool genAn(Nat n, F f) {
     return nd;
   }();
   std::reverse(digits, digits + nd);
-  for (int mask = (1<< (nd - 1 )); mask > 0; --mask) {
-    Nat total = 0, sum = 0;
-    for (int i = 0, mk = mask - 1; i < nd; ++i, mk >>= 1) {
-      sum = sum * 10 + digits[i];
-      const auto gate = mk & 1;
-      // If gate is 0:
-      //  - add sum to total
-      //  - reset sum to 0
-      // If gate is 1:
-      //  - do nothing 
-      total += sum * (gate ^ 1);
-      sum *= gate;
-    }
-    assert(sum == 0);
+  // segment[a][b] is the number with the digits a..b.
+  Nat segment[20][20];
+  Nat total = 0;
+  for (int a = 0; a < nd; ++a) {
+    Nat value = 0;
+    for (int b = a; b < nd; ++b) {
+      value = value * 10 + digits[b];
+      segment[a][b] = value;
+    }
+    total += digits[a];
+  }
+  // Bit i of 'joined' glues digit i to digit i + 1; all cut to start with.
+  uint32_t joined = 0;
+  if (f(total)) {
+    return true;
+  }
+  for (uint32_t step = 1; step < (1u << (nd - 1)); ++step) {
+    const int gap = __builtin_ctz(step);
+    // The part left of the gap starts after the last cut before it, the part
+    // right of it ends at the first cut after it. Digit nd - 1 is always the
+    // end of a part.
+    const uint32_t cutsBefore = ~joined & ((1u << gap) - 1);
+    const int a = cutsBefore == 0 ? 0 : 32 - __builtin_clz(cutsBefore);
+    const int b = __builtin_ctz(~joined & ~((2u << gap) - 1));
+    const Nat parts = segment[a][gap] + segment[gap + 1][b];
+    if (joined & (1u << gap)) {
+      total += parts - segment[a][b];
+    } else {
+      total += segment[a][b] - parts;
+    }
+    joined ^= 1u << gap;
     if (f(total)) {
       return true;
     }
@@ -61,6 +85,59 @@ bool genAn(Nat n, F f) {
   return false;
 }
 
+// A depth-first search for a split of digits[pos..nd) whose parts add up to
+// 'target' - 'partial'. Whatever the split, the rest of the digits from pos
+// adds up to between minRest[pos] (all digits apart) and maxRest[pos] (one
+// part), so most branches, and most x, are cut off after a few digits.
+struct SplitSearch {
+  int digits[20];
+  int nd = 0;
+  Nat minRest[21], maxRest[21];
+  Nat target;
+
+  SplitSearch(Nat x, Nat target) : target(target) {
+    for (; x > 0; x /= 10) {
+      digits[nd++] = x % 10;
+    }
+    std::reverse(digits, digits + nd);
+    minRest[nd] = maxRest[nd] = 0;
+    for (int i = nd - 1, scale = 0; i >= 0; --i, ++scale) {
+      minRest[i] = minRest[i + 1] + digits[i];
+      maxRest[i] = maxRest[i + 1] + digits[i] * pow10[scale];
+    }
+  }
+
+  bool reaches(int pos, Nat partial) const {
+    if (partial + minRest[pos] > target || partial + maxRest[pos] < target) {
+      return false;
+    }
+    if (pos == nd) {
+      return true;
+    }
+    Nat part = 0;
+    for (int end = pos; end < nd; ++end) {
+      part = part * 10 + digits[end];
+      // part + minRest[end + 1] only grows with 'end'.
+      if (partial + part + minRest[end + 1] > target) {
+        return false;
+      }
+      if (reaches(end + 1, partial + part)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static constexpr auto pow10 = [] {
+    std::array<Nat, 20> p{};
+    p[0] = 1;
+    for (int i = 1; i < 20; ++i) {
+      p[i] = p[i - 1] * 10;
+    }
+    return p;
+  }();
+};
+
 bool AxContains(Nat x, Nat n) {
   auto fastPath = [=] {
     if ((x % n) != 0) {
@@ -83,7 +160,7 @@ bool AxContains(Nat x, Nat n) {
   if (fastPath) {
     return true;
   }
-  return genAn(x, [&] (Nat y) { return y == n; });
+  return SplitSearch(x, n).reaches(0, 0);
 }
 
 TEST(smallTest, Basic) {
@@ -120,15 +197,44 @@ TEST(smallTest, Basic) {
   EXPECT_FALSE(AxContains(31658, 31657));
 }
 
+// How many n the necessary conditions for n in A_x rejected before any
+// split was generated. The magnitude bounds (digit sum of x <= n <= x) are
+// the first check of SplitSearch and almost never fail here.
+struct FilterStats {
+  uint64_t numbers = 0;
+  // Every split sum of x = n * a is x mod 9, and so is every a in A_n with
+  // respect to n. So n = n * a = n * n (mod 9), which holds only for
+  // n = 0 or 1 (mod 9).
+  uint64_t mod9 = 0;
+  // Candidates x = n * a passed on to the split search.
+  uint64_t searched = 0;
+
+  FilterStats& operator+=(const FilterStats& rhs) {
+    numbers += rhs.numbers;
+    mod9 += rhs.mod9;
+    searched += rhs.searched;
+    return *this;
+  }
+};
+
 Nat solve(int N, int numThreads) {
   LOG(INFO) << "Using " << numThreads << " threads";
   std::vector<std::vector<Nat>> answers(numThreads);
+  std::vector<FilterStats> stats(numThreads);
   std::vector<std::thread> threads;
   for (int id = 0; id < numThreads; ++id) {
-    threads.push_back(std::thread([N, id, numThreads, &answers] {
+    threads.push_back(std::thread([N, id, numThreads, &answers, &stats] {
+      // Counted locally so that the threads do not share cache lines.
+      FilterStats st;
       for (int n=id+1; n <= N; n += numThreads) {
-        auto cb = [&](Nat x) {
-          x *= n;
+        ++st.numbers;
+        if (n % 9 > 1) {
+          ++st.mod9;
+          continue;
+        }
+        auto cb = [&](Nat a) {
+          const Nat x = a * n;
+          ++st.searched;
           if (AxContains(x, n)) {
             answers[id].push_back(x);
             LOG_IF(INFO, (answers[id].size() % 1729) == 0) << "Found " << answers[id].size() << "-th answer for thread " << id << ": " << x;
@@ -137,12 +243,20 @@ Nat solve(int N, int numThreads) {
         };
         genAn(n, cb);
       }
+      stats[id] = st;
     }));
   }
   for (int id = 0; id < numThreads; ++id) {
     threads[id].join();
     LOG(INFO) << "Thread " << id << " finished with " << answers[id].size() << " answers";
   }
+  FilterStats totalStats;
+  for (const auto& st : stats) {
+    totalStats += st;
+  }
+  LOG(INFO) << "Of " << totalStats.numbers << " numbers n, " << totalStats.mod9
+            << " failed mod 9; " << totalStats.searched
+            << " candidates were searched";
   Nat total = 0;
   std::unordered_set<Nat> unique;
   for (auto& s : answers) {
@@ -190,6 +304,53 @@ Nat bruteForce(int N) {
   return total;
 }
 
+// All split sums of n, by splitting its decimal string recursively.
+std::vector<Nat> splitSums(const std::string& digits) {
+  std::vector<Nat> sums = {std::stoull(digits)};
+  for (size_t i = 1; i < digits.size(); ++i) {
+    const Nat head = std::stoull(digits.substr(0, i));
+    for (auto rest : splitSums(digits.substr(i))) {
+      sums.push_back(head + rest);
+    }
+  }
+  return sums;
+}
+
+TEST(smallTest, GenAnVisitsEverySplit) {
+  for (Nat n : {1ULL, 9ULL, 10ULL, 123ULL, 31658ULL, 1000001ULL, 987654321ULL,
+                99999999999999ULL, 12345678901234ULL}) {
+    std::vector<Nat> visited;
+    genAn(n, [&](Nat x) { visited.push_back(x); return false; });
+    auto expected = splitSums(std::to_string(n));
+    std::sort(visited.begin(), visited.end());
+    std::sort(expected.begin(), expected.end());
+    EXPECT_EQ(visited, expected) << n;
+  }
+  // Stops at the first true. Of the 16 splits of 31658, the unsplit one is
+  // the 11th in Gray code order.
+  int calls = 0;
+  EXPECT_TRUE(genAn(31658, [&](Nat x) { ++calls; return x == 31658; }));
+  EXPECT_EQ(calls, 11);
+  calls = 0;
+  EXPECT_FALSE(genAn(31658, [&](Nat x) { ++calls; return x == 31657; }));
+  EXPECT_EQ(calls, 16);
+}
+
+TEST(smallTest, AxContainsMatchesGenAn) {
+  for (Nat x : {7ULL, 10ULL, 123ULL, 31658ULL, 1000001ULL, 90909090ULL,
+                987654321ULL, 12345678901234ULL}) {
+    std::unordered_set<Nat> ax;
+    genAn(x, [&](Nat y) { ax.insert(y); return false; });
+    Nat maxY = *std::max_element(ax.begin(), ax.end());
+    for (Nat n = 1; n <= std::min<Nat>(maxY + 1, 200'000); ++n) {
+      ASSERT_EQ(AxContains(x, n), ax.count(n) > 0) << x << " " << n;
+    }
+    for (Nat y : ax) {
+      ASSERT_TRUE(AxContains(x, y)) << x << " " << y;
+    }
+  }
+}
+
 TEST(solveTest, Basic) {
   EXPECT_EQ(bruteForce(1'000), solve(1'000, 31));
   EXPECT_EQ(bruteForce(10'000), solve(10'000, 31));
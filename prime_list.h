@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include <glog/logging.h>
+
+// An increasing list of primes stored as gaps. Gaps between odd primes are
+// even, so a gap of up to 510 takes one byte holding half of it. Any other gap
+// is an escape byte 0 followed by the 8-byte gap. Every kCheckpointInterval-th
+// prime is also kept in full together with the offset of the gaps after it,
+// for random access. About 1.1 bytes per prime instead of 8.
+class PrimeList {
+public:
+  static constexpr size_t kCheckpointInterval = 128;
+
+  PrimeList() = default;
+  template <typename Range>
+  explicit PrimeList(const Range& primes) {
+    for (uint64_t p : primes) {
+      push_back(p);
+    }
+    shrinkToFit();
+  }
+
+  // 'p' must be larger than back().
+  void push_back(uint64_t p) {
+    if (size_ % kCheckpointInterval == 0) {
+      checkpoints_.push_back(Checkpoint{.value = p, .offset = gaps_.size()});
+    } else {
+      DCHECK_GT(p, back_);
+      const uint64_t gap = p - back_;
+      if (gap % 2 == 0 && gap <= 2 * 255) {
+        gaps_.push_back(gap / 2);
+      } else {
+        gaps_.push_back(0);
+        const auto* bytes = reinterpret_cast<const uint8_t*>(&gap);
+        gaps_.insert(gaps_.end(), bytes, bytes + sizeof gap);
+      }
+    }
+    back_ = p;
+    ++size_;
+  }
+
+  // Releases the spare capacity left by push_back.
+  void shrinkToFit() {
+    gaps_.shrink_to_fit();
+    checkpoints_.shrink_to_fit();
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  uint64_t back() const { return back_; }
+  // Bytes used by the gaps and checkpoints.
+  size_t memoryBytes() const {
+    return gaps_.capacity() + checkpoints_.capacity() * sizeof(Checkpoint);
+  }
+
+  class Iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = uint64_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const uint64_t*;
+    using reference = uint64_t;
+
+    Iterator() = default;
+    uint64_t operator*() const { return value_; }
+    Iterator& operator++() {
+      if (++index_ < list_->size_) {
+        if (index_ % kCheckpointInterval == 0) {
+          value_ = list_->checkpoints_[index_ / kCheckpointInterval].value;
+        } else {
+          value_ += list_->decodeGap(offset_);
+        }
+      }
+      return *this;
+    }
+    Iterator operator++(int) {
+      auto it = *this;
+      ++*this;
+      return it;
+    }
+    bool operator==(const Iterator& rhs) const { return index_ == rhs.index_; }
+    bool operator!=(const Iterator& rhs) const { return index_ != rhs.index_; }
+    size_t index() const { return index_; }
+
+  private:
+    friend class PrimeList;
+    Iterator(const PrimeList* list, size_t index) : list_(list), index_(index) {
+      if (index_ < list_->size_) {
+        const auto& cp = list_->checkpoints_[index_ / kCheckpointInterval];
+        value_ = cp.value;
+        offset_ = cp.offset;
+        for (size_t i = 0; i < index_ % kCheckpointInterval; ++i) {
+          value_ += list_->decodeGap(offset_);
+        }
+      }
+    }
+
+    const PrimeList* list_ = nullptr;
+    size_t index_ = 0;
+    size_t offset_ = 0; // The gap to the next prime.
+    uint64_t value_ = 0;
+  };
+
+  Iterator begin() const { return Iterator(this, 0); }
+  Iterator end() const { return Iterator(this, size_); }
+  // The iterator at index i, decoding at most kCheckpointInterval - 1 gaps.
+  Iterator at(size_t i) const { return Iterator(this, i); }
+  uint64_t operator[](size_t i) const { return *at(i); }
+
+private:
+  // The gap starting at 'offset', moving 'offset' past it.
+  uint64_t decodeGap(size_t& offset) const {
+    const uint8_t half = gaps_[offset++];
+    if (half != 0) {
+      return 2 * half;
+    }
+    uint64_t gap;
+    std::memcpy(&gap, gaps_.data() + offset, sizeof gap);
+    offset += sizeof gap;
+    return gap;
+  }
+
+  struct Checkpoint {
+    uint64_t value;
+    uint64_t offset;
+  };
+  std::vector<uint8_t> gaps_;
+  std::vector<Checkpoint> checkpoints_;
+  size_t size_ = 0;
+  uint64_t back_ = 0;
+};
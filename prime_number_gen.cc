@@ -1,50 +1,1093 @@
 #include "prime_number_gen.h"
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <fstream>
 #include <glog/logging.h>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-PrimeNumberGen::PrimeNumberGen(uint64_t low, uint64_t high)
-    : low_(low), high_(high) {
-  CHECK_GT(high, low);
-  CHECK_GT(low, 0u);
-  DLOG(INFO) << "Initing the prime number table of size " << high;
+namespace {
+
+using Wheel = std::array<uint64_t, 8>;
+constexpr const Wheel& kWheel = PrimeNumberGen::kWheel;
+constexpr const auto& kResidueBit = PrimeNumberGen::kResidueBit;
+
+// Number of bytes sieved per block. 32 KiB fits the L1 data cache of most x86
+// cores, so all crossing-off stores stay in cache. One byte holds 30 numbers.
+constexpr uint64_t kSegmentBytes = uint64_t(1) << 15;
+
+constexpr uint64_t kCacheLineBytes = 64;
+constexpr uint64_t kHugePageBytes = uint64_t(1) << 21;
+
+// kWheel[i + 1] - kWheel[i], wrapping around to 31.
+constexpr Wheel kGap = {6, 4, 2, 4, 2, 4, 6, 2};
+
+// Walking the multiples p * q of a prime p = 30 * a + kWheel[r] with q coprime
+// to 30: when q is at wheel index w, kMask[r][w] is the bit of p * q in its
+// byte and the byte index grows by a * kGap[w] + kCarry[r][w] to get to the
+// next multiple.
+using WheelTable = std::array<std::array<uint8_t, 8>, 8>;
+constexpr WheelTable kMask = [] {
+  WheelTable mask{};
+  for (int r = 0; r < 8; ++r) {
+    for (int w = 0; w < 8; ++w) {
+      mask[r][w] = 1 << kResidueBit[kWheel[r] * kWheel[w] % 30];
+    }
+  }
+  return mask;
+}();
+constexpr WheelTable kCarry = [] {
+  WheelTable carry{};
+  for (int r = 0; r < 8; ++r) {
+    for (int w = 0; w < 8; ++w) {
+      carry[r][w] = (kWheel[r] * kWheel[w] % 30 + kWheel[r] * kGap[w]) / 30;
+    }
+  }
+  return carry;
+}();
+
+// The wheel bytes repeat their multiples of 7, 11 and 13 every 7 * 11 * 13
+// bytes. Blocks start as a copy of this pattern, so crossing off starts at 17.
+constexpr uint64_t kPreSievePeriod = 7 * 11 * 13;
+constexpr uint64_t kFirstSievingPrime = 17;
+constexpr std::array<uint8_t, kPreSievePeriod> kPreSievePattern = [] {
+  std::array<uint8_t, kPreSievePeriod> pattern{};
+  for (uint64_t b = 0; b < kPreSievePeriod; ++b) {
+    for (int i = 0; i < 8; ++i) {
+      const uint64_t n = b * 30 + kWheel[i];
+      if (n % 7 == 0 || n % 11 == 0 || n % 13 == 0) {
+        pattern[b] |= 1 << i;
+      }
+    }
+  }
+  return pattern;
+}();
+
+// Fills the absolute bytes [firstByte, endByte), stored at 'bytes', with the
+// pre-sieve pattern. 7, 11 and 13 themselves stay prime.
+void preSieve(uint8_t* bytes, uint64_t firstByte, uint64_t endByte) {
+  uint64_t offset = firstByte % kPreSievePeriod;
+  for (uint64_t b = firstByte; b < endByte;) {
+    const uint64_t n = std::min(kPreSievePeriod - offset, endByte - b);
+    std::memcpy(bytes + (b - firstByte), kPreSievePattern.data() + offset, n);
+    b += n;
+    offset = 0;
+  }
+  if (firstByte == 0) {
+    bytes[0] &= ~((1 << kResidueBit[7]) | (1 << kResidueBit[11]) |
+                  (1 << kResidueBit[13]));
+  }
+}
+
+// The number of clear bits in [begin, end). The default x86-64 target has no
+// popcount instruction, so the loop is also built for POPCNT and for AVX-512
+// VPOPCNTQ, which the vectorizer uses 8 words at a time, and picked at startup.
+inline __attribute__((always_inline)) uint64_t
+countClearBitsLoop(const uint64_t* begin, const uint64_t* end) {
+  uint64_t count = 0;
+  for (const uint64_t* w = begin; w != end; ++w) {
+    count += __builtin_popcountll(~*w);
+  }
+  return count;
+}
+__attribute__((target("avx512f,avx512vpopcntdq"))) uint64_t
+countClearBitsAvx512(const uint64_t* begin, const uint64_t* end) {
+  return countClearBitsLoop(begin, end);
+}
+__attribute__((target("popcnt"))) uint64_t
+countClearBitsPopcnt(const uint64_t* begin, const uint64_t* end) {
+  return countClearBitsLoop(begin, end);
+}
+uint64_t countClearBitsDefault(const uint64_t* begin, const uint64_t* end) {
+  return countClearBitsLoop(begin, end);
+}
+const auto countClearBits = [] {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512vpopcntdq")) {
+    return &countClearBitsAvx512;
+  }
+  return __builtin_cpu_supports("popcnt") ? &countClearBitsPopcnt
+                                          : &countClearBitsDefault;
+}();
+
+uint64_t isqrt(uint64_t n) {
+  uint64_t res = static_cast<uint64_t>(std::sqrt(n)) + 2;
+  while (res * res > n) {
+    --res;
+  }
+  return res;
+}
+
+// Appends the primes in (primes.back(), limit] to the sorted list 'primes',
+// sieving only the new part with the primes already known.
+void growBasePrimes(std::vector<uint64_t>& primes, uint64_t limit) {
+  if (limit < 2 || (!primes.empty() && primes.back() >= limit)) {
+    return;
+  }
+  // The new part needs the primes up to sqrt(limit) first.
+  growBasePrimes(primes, isqrt(limit));
+  const uint64_t from = primes.empty() ? 2 : primes.back() + 1;
+  std::vector<bool> composite(limit - from + 1, false);
+  for (auto p : primes) {
+    if (p * p > limit) {
+      break;
+    }
+    for (uint64_t n = std::max(p * p, (from + p - 1) / p * p); n <= limit;
+         n += p) {
+      composite[n - from] = true;
+    }
+  }
+  for (uint64_t n = from; n <= limit; ++n) {
+    if (!composite[n - from]) {
+      primes.push_back(n);
+    }
+  }
+}
+
+// A prime p >= kFirstSievingPrime together with its next multiple to cross
+// off.
+struct SievingPrime {
+  uint64_t prime;
+  uint64_t next;   // Absolute byte index (multiple / 30) of the next multiple.
+  uint32_t step;   // p / 30
+  uint8_t residue; // Wheel index of p % 30.
+  uint8_t wheel;   // Wheel index of the multiplier of the next multiple.
+};
+
+// Starts p at its first multiple p * q >= max(p * p, 30 * fromByte) with q
+// coprime to 30. Smaller multiples have a smaller prime factor.
+SievingPrime makeSievingPrime(uint64_t p, uint64_t fromByte) {
+  const uint64_t from = std::max(p * p, fromByte * 30);
+  uint64_t q = (from + p - 1) / p;
+  while (kResidueBit[q % 30] < 0) {
+    ++q;
+  }
+  return SievingPrime{
+      .prime = p,
+      .next = p * q / 30,
+      .step = static_cast<uint32_t>(p / 30),
+      .residue = static_cast<uint8_t>(kResidueBit[p % 30]),
+      .wheel = static_cast<uint8_t>(kResidueBit[q % 30]),
+  };
+}
+
+// Crosses off the multiples of 'primes' in the absolute bytes
+// [firstByte, endByte), stored at 'bytes'. Each prime is left at its first
+// multiple at or beyond endByte.
+void crossOff(uint8_t* bytes, uint64_t firstByte, uint64_t endByte,
+              std::vector<SievingPrime>& primes) {
+  for (auto& sp : primes) {
+    if (sp.prime * sp.prime >= endByte * 30) {
+      // Primes are sorted, so no larger prime hits this block either.
+      break;
+    }
+    const auto& mask = kMask[sp.residue];
+    const auto& carry = kCarry[sp.residue];
+    uint64_t b = sp.next;
+    int w = sp.wheel;
+    while (b < endByte) {
+      bytes[b - firstByte] |= mask[w];
+      b += sp.step * kGap[w] + carry[w];
+      w = (w + 1) & 7;
+    }
+    sp.next = b;
+    sp.wheel = w;
+  }
+}
 
-  // Allocate bit vector: (high + 2) bits for sentinel, stored in uint64_t words
-  // Use a bit vector to reduce memory usage. Memory access is the bottleneck.
-  uint64_t arraySize = high / 64 + 2;
-  notPrime_.resize(arraySize, 0);
+// Primes above this hit a segment less than once on average: a segment has
+// kSegmentBytes * 8 wheel positions and p hits one in every p of them.
+constexpr uint64_t kBucketSievingPrime = kSegmentBytes * 8;
 
-  // 0 and 1 are not prime
-  setNotPrime(0);
-  setNotPrime(1);
+// Bucket sieve (Oliveira e Silva) for the sieving primes which mostly skip a
+// segment. Each prime waits in the bucket of the segment of its next
+// multiple, so a segment only touches the primes which hit it.
+class BucketSieve {
+public:
+  // Sieving [firstByte, endByte) with primes up to 'maxPrime'.
+  BucketSieve(uint64_t firstByte, uint64_t endByte, uint64_t maxPrime)
+      : firstByte_(firstByte), endByte_(endByte),
+        // Consecutive multiples are at most 6 * (maxPrime / 30) + 6 bytes
+        // apart, so the buckets in flight fit in a ring of this many.
+        buckets_(maxPrime / 5 / kSegmentBytes + 2) {}
 
-  const uint64_t sqrtHigh = [high]() {
-    uint64_t res = static_cast<uint64_t>(std::sqrt(high)) + 2;
-    while (res * res > high) {
-      --res;
+  // sp.next must lie within the ring, i.e. before the segment of the last
+  // crossOff() plus buckets_.size() segments.
+  void add(const SievingPrime& sp) {
+    if (sp.next < endByte_) {
+      place(sp.next, sp.step, sp.residue, sp.wheel);
+    }
+  }
+
+  // Crosses off the multiples in the segment [segBegin, segEnd), stored at
+  // 'bytes', and moves the primes on to the buckets of their next multiple.
+  void crossOff(uint8_t* bytes, uint64_t segBegin, uint64_t segEnd) {
+    auto& bucket = buckets_[segmentOf(segBegin) % buckets_.size()];
+    spare_.swap(bucket);
+    for (const auto& bp : spare_) {
+      const auto& mask = kMask[bp.residue];
+      const auto& carry = kCarry[bp.residue];
+      uint64_t b = segBegin + bp.offset;
+      int w = bp.wheel;
+      do {
+        bytes[b - segBegin] |= mask[w];
+        b += bp.step * kGap[w] + carry[w];
+        w = (w + 1) & 7;
+      } while (b < segEnd);
+      if (b < endByte_) {
+        place(b, bp.step, bp.residue, w);
+      }
+    }
+    spare_.clear();
+  }
+
+private:
+  struct BucketPrime {
+    uint32_t step;   // p / 30
+    uint32_t offset; // Byte of the next multiple within its segment.
+    uint8_t residue;
+    uint8_t wheel;
+  };
+
+  uint64_t segmentOf(uint64_t byte) const {
+    return (byte - firstByte_) / kSegmentBytes;
+  }
+  void place(uint64_t byte, uint32_t step, uint8_t residue, uint8_t wheel) {
+    buckets_[segmentOf(byte) % buckets_.size()].push_back(BucketPrime{
+        .step = step,
+        .offset = static_cast<uint32_t>((byte - firstByte_) % kSegmentBytes),
+        .residue = residue,
+        .wheel = wheel,
+    });
+  }
+
+  uint64_t firstByte_, endByte_;
+  std::vector<std::vector<BucketPrime>> buckets_;
+  std::vector<BucketPrime> spare_;
+};
+
+// Sieves the absolute bytes [firstByte, endByte), stored at 'bytes', block by
+// block so that the crossing-off stores hit a cache-resident window. Each
+// sieving prime carries its next multiple from one block to the following one;
+// the large ones do so through buckets.
+void sieveBytes(uint8_t* bytes, uint64_t firstByte, uint64_t endByte,
+                const std::vector<uint64_t>& basePrimes) {
+  std::vector<SievingPrime> primes;
+  BucketSieve buckets(firstByte, endByte,
+                      basePrimes.empty() ? 0 : basePrimes.back());
+  size_t next = 0;
+  for (; next < basePrimes.size(); ++next) {
+    const uint64_t p = basePrimes[next];
+    if (p * p >= endByte * 30) {
+      // Neither this nor any larger prime has a multiple to cross off.
+      break;
+    }
+    if (p < kFirstSievingPrime) {
+      continue;
+    }
+    if (p < kBucketSievingPrime) {
+      primes.push_back(makeSievingPrime(p, firstByte));
+    } else if (p * p < firstByte * 30) {
+      buckets.add(makeSievingPrime(p, firstByte));
+    } else {
+      // The first multiple is p^2, possibly further ahead than the ring of
+      // buckets reaches. Such primes join in the segment of their square.
+      break;
+    }
+  }
+  for (uint64_t segBegin = firstByte; segBegin < endByte;
+       segBegin += kSegmentBytes) {
+    const uint64_t segEnd = std::min(segBegin + kSegmentBytes, endByte);
+    for (; next < basePrimes.size() &&
+           basePrimes[next] * basePrimes[next] < segEnd * 30;
+         ++next) {
+      if (basePrimes[next] >= kFirstSievingPrime) {
+        buckets.add(makeSievingPrime(basePrimes[next], firstByte));
+      }
+    }
+    uint8_t* segment = bytes + (segBegin - firstByte);
+    preSieve(segment, segBegin, segEnd);
+    crossOff(segment, segBegin, segEnd, primes);
+    buckets.crossOff(segment, segBegin, segEnd);
+  }
+}
+
+// Arithmetic modulo an odd n on numbers in Montgomery form a * 2^64 mod n.
+class Montgomery {
+public:
+  explicit Montgomery(uint64_t n) : n_(n) {
+    // Newton's iteration doubles the number of correct low bits each step.
+    inv_ = n;
+    for (int i = 0; i < 5; ++i) {
+      inv_ *= 2 - n * inv_;
+    }
+    one_ = -n % n;
+    r2_ = static_cast<unsigned __int128>(one_) * one_ % n;
+  }
+
+  uint64_t one() const { return one_; }
+  uint64_t minusOne() const { return n_ - one_; }
+  uint64_t to(uint64_t a) const { return mul(a % n_, r2_); }
+
+  uint64_t mul(uint64_t a, uint64_t b) const {
+    return reduce(static_cast<unsigned __int128>(a) * b);
+  }
+
+  uint64_t pow(uint64_t a, uint64_t e) const {
+    uint64_t res = one_;
+    for (; e > 0; e >>= 1) {
+      if (e & 1) {
+        res = mul(res, a);
+      }
+      a = mul(a, a);
     }
     return res;
-  }();
-  for (uint64_t p = 2; p <= sqrtHigh; ++p) {
-    if (isNotPrime(p)) {
+  }
+
+private:
+  // t * 2^-64 mod n for t < n * 2^64. q * n agrees with t on the low 64 bits,
+  // so only the high halves need subtracting.
+  uint64_t reduce(unsigned __int128 t) const {
+    const uint64_t q = static_cast<uint64_t>(t) * inv_;
+    const uint64_t hi = t >> 64;
+    const uint64_t qn = (static_cast<unsigned __int128>(q) * n_) >> 64;
+    return hi >= qn ? hi - qn : hi - qn + n_;
+  }
+
+  uint64_t n_;
+  uint64_t inv_; // n^-1 mod 2^64
+  uint64_t one_; // 2^64 mod n
+  uint64_t r2_;  // 2^128 mod n
+};
+
+// Layout of a sieve cache file: the header, then the words of the bitset at
+// kCacheWordsOffset, then the superblock and block ranks.
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t wheel;
+  uint64_t low;
+  uint64_t high;
+  uint64_t numWords;
+  uint64_t numSupers;
+  uint64_t numBlocks;
+  uint64_t checksum;
+};
+constexpr char kCacheMagic[8] = {'P', 'N', 'G', 'S', 'I', 'E', 'V', 'E'};
+constexpr uint32_t kCacheVersion = 1;
+// Page aligned, so the bitset starts on a fresh page.
+constexpr uint64_t kCacheWordsOffset = 4096;
+
+uint64_t cacheFileBytes(const CacheHeader& header) {
+  return kCacheWordsOffset +
+         (header.numWords + header.numSupers) * sizeof(uint64_t) +
+         header.numBlocks * sizeof(uint16_t);
+}
+
+uint64_t checksum(const uint64_t* words, uint64_t numWords) {
+  uint64_t hash = 0;
+  for (uint64_t i = 0; i < numWords; ++i) {
+    hash = (hash ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+} // namespace
+
+uint64_t nthPrimeUpperBound(uint64_t k) {
+  CHECK_GT(k, 0u);
+  if (k < 6) {
+    return std::array<uint64_t, 6>{0, 2, 3, 5, 7, 11}[k];
+  }
+  const long double logK = std::log(static_cast<long double>(k));
+  const long double logLogK = std::log(logK);
+  const long double bound =
+      k * (logK + logLogK - (k >= 39017 ? 0.9484L : 0.0L));
+  // One more for the rounding of the logarithms. Saturates at 2^64 - 1.
+  if (bound >= 0x1p64L - 2) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  return static_cast<uint64_t>(std::ceil(bound)) + 1;
+}
+
+uint64_t primeCountUpperBound(uint64_t x) {
+  if (x < 2) {
+    return 0;
+  }
+  const long double logX = std::log(static_cast<long double>(x));
+  return static_cast<uint64_t>(std::ceil(x / logX * (1 + 1.2762L / logX))) + 1;
+}
+
+bool isPrimeMillerRabin(uint64_t n) {
+  for (uint64_t p : {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37}) {
+    if (n % p == 0) {
+      return n == p;
+    }
+  }
+  if (n < 41 * 41) {
+    return n > 1;
+  }
+  const int s = __builtin_ctzll(n - 1);
+  const uint64_t d = (n - 1) >> s;
+  const Montgomery mont(n);
+  for (uint64_t a : {2ULL, 325ULL, 9375ULL, 28178ULL, 450775ULL, 9780504ULL,
+                     1795265022ULL}) {
+    if (a % n == 0) {
+      continue;
+    }
+    uint64_t x = mont.pow(mont.to(a), d);
+    if (x == mont.one() || x == mont.minusOne()) {
       continue;
     }
-    for (uint64_t n = p * p; n <= high; n += p) {
-      setNotPrime(n);
+    bool composite = true;
+    for (int i = 1; i < s && composite; ++i) {
+      x = mont.mul(x, x);
+      composite = x != mont.minusOne();
+    }
+    if (composite) {
+      return false;
     }
   }
+  return true;
+}
+
+void* allocateSieveMemory(size_t bytes, SieveMemory memory) {
+  if (memory.hugePages && bytes >= kHugePageBytes) {
+    const size_t size = (bytes + kHugePageBytes - 1) / kHugePageBytes *
+                        kHugePageBytes;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      return p;
+    }
+    // No reserved huge pages: map a huge-page aligned range and ask for
+    // transparent ones.
+    auto* raw = static_cast<uint8_t*>(mmap(nullptr, size + kHugePageBytes,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    PCHECK(raw != MAP_FAILED) << "Cannot map " << size << " bytes";
+    auto* aligned = reinterpret_cast<uint8_t*>(
+        (reinterpret_cast<uintptr_t>(raw) + kHugePageBytes - 1) /
+        kHugePageBytes * kHugePageBytes);
+    if (aligned != raw) {
+      munmap(raw, aligned - raw);
+    }
+    munmap(aligned + size, raw + kHugePageBytes - aligned);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+  }
+  if (memory.firstTouch || memory.hugePages) {
+    // Anonymous pages read as zero and get placed on their first write.
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    PCHECK(p != MAP_FAILED) << "Cannot map " << bytes << " bytes";
+    return p;
+  }
+  const size_t size =
+      (bytes + kCacheLineBytes - 1) / kCacheLineBytes * kCacheLineBytes;
+  void* p = std::aligned_alloc(kCacheLineBytes, size);
+  CHECK(p != nullptr) << "Cannot allocate " << size << " bytes";
+  return std::memset(p, 0, size);
+}
+
+void freeSieveMemory(void* p, size_t bytes, SieveMemory memory) {
+  if (memory.hugePages && bytes >= kHugePageBytes) {
+    munmap(p, (bytes + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes);
+  } else if (memory.firstTouch || memory.hugePages) {
+    munmap(p, bytes);
+  } else {
+    std::free(p);
+  }
+}
+
+PrimeNumberGen::PrimeNumberGen(uint64_t low, uint64_t high, int numThreads,
+                               SieveMemory memory)
+    : low_(low), high_(high), base_(low / 30) {
+  CHECK_GT(high, low);
+  CHECK_GT(low, 0u);
+  CHECK_GT(numThreads, 0);
+  DLOG(INFO) << "Initing the prime number table of size " << high;
+
+  // Allocate the wheel bitset for the bytes covering [low, high], rounded up
+  // to whole words. Only the window is stored, so a narrow range far from zero
+  // stays small. Memory access is the bottleneck.
+  notPrime_.setMemory(memory);
+  notPrime_.resize((numBytes() + 7) / 8, 0);
+  sieve(0, numThreads);
+  maskOutOfRange();
+  buildRankIndex(0, numThreads);
   DLOG(INFO) << "Initialized the prime number table of size " << high;
 }
 
-PrimeNumberGen::~PrimeNumberGen() = default;
+void PrimeNumberGen::sieve(uint64_t firstByte, int numThreads) {
+  CHECK_GT(numThreads, 0);
+  growBasePrimes(basePrimes_, isqrt(high_));
+  auto* bytes = reinterpret_cast<uint8_t*>(notPrime_.data());
+  const uint64_t endByte = numBytes();
+
+  // Each worker sieves its own contiguous run of bytes, so the result does not
+  // depend on the thread count. Runs are aligned to cache lines to keep the
+  // workers off each other's lines, or to huge pages so that each page is
+  // first touched by the worker which owns it. The boundaries are multiples
+  // of the alignment in the table, which starts aligned, so after extendTo()
+  // only the first run starts mid-line at 'firstByte'.
+  const uint64_t align =
+      notPrime_.memory().hugePages ? kHugePageBytes : kCacheLineBytes;
+  const uint64_t alignedFirst = firstByte / align * align;
+  const uint64_t chunkBytes = std::max(
+      kSegmentBytes,
+      ((endByte - firstByte) / numThreads + align - 1) / align * align);
+  const int numChunks = (endByte - alignedFirst + chunkBytes - 1) / chunkBytes;
+#pragma omp parallel for num_threads(numThreads) schedule(static, 1)
+  for (int i = 0; i < numChunks; ++i) {
+    const uint64_t chunkBegin =
+        std::max(firstByte, alignedFirst + i * chunkBytes);
+    const uint64_t chunkEnd =
+        std::min(alignedFirst + (i + 1) * chunkBytes, endByte);
+    sieveBytes(bytes + chunkBegin, base_ + chunkBegin, base_ + chunkEnd,
+               basePrimes_);
+  }
+}
+
+void PrimeNumberGen::maskOutOfRange() {
+  // Mask out the numbers outside [low, high], including 1, and the padding
+  // bits of the last word.
+  auto* bytes = reinterpret_cast<uint8_t*>(notPrime_.data());
+  const uint64_t lastByte = numBytes() - 1;
+  for (int i = 0; i < 8; ++i) {
+    if (base_ * 30 + kWheel[i] < std::max<uint64_t>(low_, 2)) {
+      bytes[0] |= 1 << i;
+    }
+    if ((base_ + lastByte) * 30 + kWheel[i] > high_) {
+      bytes[lastByte] |= 1 << i;
+    }
+  }
+  std::fill(bytes + lastByte + 1, bytes + notPrime_.size() * 8, 0xff);
+}
+
+void PrimeNumberGen::extendTo(uint64_t newHigh, int numThreads) {
+  if (newHigh <= high_) {
+    return;
+  }
+  DLOG(INFO) << "Extending the prime number table from " << high_ << " to "
+             << newHigh;
+  // The last byte of the old range was masked beyond high_, so it is sieved
+  // again together with the new bytes. Bytes before it are left untouched.
+  const uint64_t firstByte = numBytes() - 1;
+  const uint64_t firstWord = firstByte / 8;
+  high_ = newHigh;
+  notPrime_.resize((numBytes() + 7) / 8, 0);
+  sieve(firstByte, numThreads);
+  maskOutOfRange();
+  buildRankIndex(firstWord, numThreads);
+}
+
+std::unique_ptr<PrimeNumberGen> PrimeNumberGen::forFirstKPrimes(
+    uint64_t k, uint64_t minValue, int numThreads) {
+  // At most primeCountUpperBound(minValue - 1) primes come before minValue,
+  // so the k-th prime from minValue is at most the bound for that many more.
+  const uint64_t low = std::max<uint64_t>(minValue, 1);
+  const uint64_t skipped = primeCountUpperBound(low - 1);
+  // Kept below 2^64 - 30 so that the bytes covering it stay addressable.
+  const uint64_t maxHigh = std::numeric_limits<uint64_t>::max() - 30;
+  uint64_t high = std::min(nthPrimeUpperBound(skipped + k), maxHigh);
+  if (low >= 396738) {
+    // That is loose far from zero. There, (x, x (1 + 1 / (25 ln^2 x))] holds
+    // a prime for x >= 396738 (Dusart), and the factor only shrinks as x
+    // grows, so k steps stay below low * exp(k / (25 ln^2 low)).
+    const long double logLow = std::log(static_cast<long double>(low));
+    const long double gapBound =
+        low * std::exp(k / (25 * logLow * logLow)) + k + 1;
+    if (gapBound < high) {
+      high = static_cast<uint64_t>(gapBound);
+    }
+  }
+  high = std::max(high, low + 1);
+  // Both bounds still allow gaps far above the average of ln x, so away from
+  // zero they can exceed the span of k primes many times over. Then the
+  // table starts at a little more than that span and doubles until it holds
+  // k primes; the proven bound caps the growth.
+  const long double logHigh = std::log(static_cast<long double>(high));
+  const long double guess = 1.25L * k * logHigh + 1000;
+  if (high - low <= 2 * guess) {
+    return std::make_unique<PrimeNumberGen>(low, high, numThreads);
+  }
+  auto gen = std::make_unique<PrimeNumberGen>(
+      low, low + static_cast<uint64_t>(guess), numThreads);
+  while (gen->pi(gen->high_) < k) {
+    CHECK_LT(gen->high_, high) << "No " << k << " primes from " << low
+                               << " below the proven bound";
+    const uint64_t span = gen->high_ - low;
+    gen->extendTo(span < high - gen->high_ ? gen->high_ + span : high,
+                  numThreads);
+  }
+  return gen;
+}
+
+uint64_t nthPrime(uint64_t k, int numThreads) {
+  return PrimeNumberGen::forFirstKPrimes(k, 2, numThreads)->nthPrime(k);
+}
+
+std::vector<uint64_t> firstKPrimes(uint64_t k, uint64_t minValue,
+                                   int numThreads) {
+  std::vector<uint64_t> primes;
+  if (k == 0) {
+    return primes;
+  }
+  const auto gen = PrimeNumberGen::forFirstKPrimes(k, minValue, numThreads);
+  gen->extract(minValue, gen->nthPrime(k), primes);
+  return primes;
+}
+
+uint64_t countPrimes(uint64_t x, int numThreads) {
+  CHECK_GT(numThreads, 0);
+  CHECK_LT(x, uint64_t(1) << 53) << "x / p is computed in double precision";
+  if (x < 2) {
+    return 0;
+  }
+  // S(v) starts as the count of 2..v and, after the round of prime p, counts
+  // the numbers in 2..v that are prime or have no prime factor <= p:
+  //   S(v) -= S(v / p) - S(p - 1) for v >= p^2.
+  // Only v = x / i occur; small[v] holds S(v) for v <= r and large[i] holds
+  // S(x / i) for i <= r.
+  const uint64_t r = isqrt(x);
+  std::vector<uint32_t> small(r + 1);
+  std::vector<uint64_t> large(r + 1), quotient(r + 1);
+  for (uint64_t v = 1; v <= r; ++v) {
+    small[v] = v - 1;
+    quotient[v] = x / v;
+    large[v] = quotient[v] - 1;
+  }
+  PrimeNumberGen basePrimes(1, std::max<uint64_t>(r, 2));
+  for (uint64_t p : basePrimes) {
+    if (p > r) {
+      break;
+    }
+    // v / p through a floating point reciprocal, exact after one correction
+    // for v < 2^53. Hardware division would dominate the rounds.
+    const double inverse = 1.0 / p;
+    const auto divide = [p, inverse](uint64_t v) {
+      uint64_t q = v * inverse;
+      q -= q * p > v;
+      q += (q + 1) * p <= v;
+      return q;
+    };
+    const uint64_t below = small[p - 1];
+    // Every update must read values from before the round. Entry i of
+    // 'large' reads entry i * p, and entry v of 'small' reads entry v / p, so
+    // the indices are split into levels (b, b * p] whose updates only read
+    // the level above or below. Each level is updated in place in parallel:
+    // the levels of 'large' from the bottom up, those of 'small' from the top
+    // down.
+    const uint64_t lastI = std::min(r, x / p / p);
+    uint64_t levelEnd = lastI;
+    while (levelEnd / p > 0) {
+      levelEnd /= p;
+    }
+    // Up to r / p, x / (i p) is large[i * p].
+    const uint64_t lastLarge = r / p;
+    for (uint64_t first = 1; first <= lastI;
+         first = levelEnd + 1, levelEnd *= p) {
+      const uint64_t last = std::min(levelEnd, lastI);
+      const uint64_t split = std::clamp(lastLarge, first - 1, last);
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+      for (uint64_t i = first; i <= split; ++i) {
+        large[i] -= large[i * p] - below;
+      }
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+      for (uint64_t i = split + 1; i <= last; ++i) {
+        large[i] -= small[divide(quotient[i])] - below;
+      }
+    }
+    for (uint64_t top = r; top >= p * p;) {
+      const uint64_t bottom = std::max(top / p, p * p - 1);
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+      for (uint64_t v = bottom + 1; v <= top; ++v) {
+        small[v] -= small[divide(v)] - below;
+      }
+      top = bottom;
+    }
+  }
+  return large[1];
+}
+
+PrimeNumberGen::~PrimeNumberGen() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mappingBytes_);
+  }
+}
+
+void PrimeNumberGen::save(const std::string& path) const {
+  CacheHeader header{};
+  std::memcpy(header.magic, kCacheMagic, sizeof kCacheMagic);
+  header.version = kCacheVersion;
+  header.wheel = 30;
+  header.low = low_;
+  header.high = high_;
+  header.numWords = notPrime_.size();
+  header.numSupers = superRank_.size();
+  header.numBlocks = blockRank_.size();
+  header.checksum = checksum(notPrime_.data(), notPrime_.size());
+
+  const std::string tmpPath = path + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    CHECK(out) << "Cannot write " << tmpPath;
+    std::vector<char> headerPage(kCacheWordsOffset, 0);
+    std::memcpy(headerPage.data(), &header, sizeof header);
+    out.write(headerPage.data(), headerPage.size());
+    out.write(reinterpret_cast<const char*>(notPrime_.data()),
+              notPrime_.size() * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char*>(superRank_.data()),
+              superRank_.size() * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char*>(blockRank_.data()),
+              blockRank_.size() * sizeof(uint16_t));
+    CHECK(out) << "Failed writing " << tmpPath;
+  }
+  PCHECK(std::rename(tmpPath.c_str(), path.c_str()) == 0)
+      << "Cannot rename " << tmpPath << " to " << path;
+  LOG(INFO) << "Saved the prime number table of [" << low_ << ", " << high_
+            << "] to " << path;
+}
+
+std::unique_ptr<PrimeNumberGen> PrimeNumberGen::load(const std::string& path,
+                                                     bool verifyChecksum) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  CacheHeader header{};
+  const bool readable = fstat(fd, &st) == 0 &&
+                        pread(fd, &header, sizeof header, 0) == sizeof header;
+  // The counts must match the range, or lookups would run past the arrays.
+  const bool validRange = header.low > 0 && header.high > header.low;
+  const uint64_t numWords =
+      validRange ? (header.high / 30 - header.low / 30 + 1 + 7) / 8 : 0;
+  if (!readable ||
+      std::memcmp(header.magic, kCacheMagic, sizeof kCacheMagic) != 0 ||
+      header.version != kCacheVersion || header.wheel != 30 || !validRange ||
+      header.numWords != numWords ||
+      header.numSupers !=
+          (numWords + kWordsPerSuper - 1) / kWordsPerSuper + 1 ||
+      header.numBlocks != (numWords + kWordsPerBlock - 1) / kWordsPerBlock ||
+      static_cast<uint64_t>(st.st_size) != cacheFileBytes(header)) {
+    LOG(WARNING) << "Ignoring the invalid prime number cache " << path;
+    close(fd);
+    return nullptr;
+  }
+  void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    PLOG(WARNING) << "Cannot map " << path;
+    return nullptr;
+  }
+
+  std::unique_ptr<PrimeNumberGen> gen(new PrimeNumberGen());
+  gen->mapping_ = mapping;
+  gen->mappingBytes_ = st.st_size;
+  gen->low_ = header.low;
+  gen->high_ = header.high;
+  gen->base_ = header.low / 30;
+  const char* bytes = static_cast<const char*>(mapping);
+  const auto* words =
+      reinterpret_cast<const uint64_t*>(bytes + kCacheWordsOffset);
+  gen->notPrime_.view(words, header.numWords);
+  gen->superRank_.view(words + header.numWords, header.numSupers);
+  gen->blockRank_.view(reinterpret_cast<const uint16_t*>(
+                           words + header.numWords + header.numSupers),
+                       header.numBlocks);
+  if (verifyChecksum && checksum(words, header.numWords) != header.checksum) {
+    LOG(WARNING) << "Checksum mismatch in the prime number cache " << path;
+    return nullptr;
+  }
+  return gen;
+}
+
+std::unique_ptr<PrimeNumberGen> PrimeNumberGen::cached(
+    const std::string& cacheDir, uint64_t low, uint64_t high, int numThreads,
+    SieveMemory memory) {
+  if (cacheDir.empty()) {
+    return std::make_unique<PrimeNumberGen>(low, high, numThreads, memory);
+  }
+  const std::string path = cacheDir + "/primes_" + std::to_string(low) + "_" +
+                           std::to_string(high) + ".sieve";
+  if (auto gen = load(path)) {
+    if (gen->low_ == low && gen->high_ == high) {
+      LOG(INFO) << "Loaded the prime number table from " << path;
+      return gen;
+    }
+  }
+  auto gen = std::make_unique<PrimeNumberGen>(low, high, numThreads, memory);
+  gen->save(path);
+  return gen;
+}
+
+uint64_t PrimeNumberGen::firstPosFrom(uint64_t n) const {
+  // 29 is on the wheel, so this stops within the byte of n.
+  uint64_t r = n % 30;
+  while (kResidueBit[r] < 0) {
+    ++r;
+  }
+  return (n / 30 - base_) * 8 + kResidueBit[r];
+}
+
+uint64_t PrimeNumberGen::nextPos(uint64_t pos) const {
+  // Scan whole words for a clear bit.
+  uint64_t wi = pos >> 6;
+  if (wi >= notPrime_.size()) {
+    return kNoPos;
+  }
+  uint64_t primes = ~notPrime_[wi] & (~uint64_t(0) << (pos & 63));
+  while (primes == 0) {
+    if (++wi == notPrime_.size()) {
+      // The padding bits are set, so there is no prime left.
+      return kNoPos;
+    }
+    primes = ~notPrime_[wi];
+  }
+  return wi * 64 + __builtin_ctzll(primes);
+}
+
+uint64_t PrimeNumberGen::nextPrime(uint64_t n) const {
+  // 2, 3 and 5 are not on the wheel.
+  for (uint64_t p : {2, 3, 5}) {
+    if (n < p) {
+      return p <= high_ ? p : high_ + 1;
+    }
+  }
+  // n + 1 >= low_, so it is in the bitset.
+  const uint64_t pos = nextPos(firstPosFrom(n + 1));
+  return pos == kNoPos ? high_ + 1 : numberAt(pos);
+}
+
+uint64_t PrimeNumberGen::isPrimeBatch(std::span<const uint64_t> in,
+                                      std::span<uint64_t> mask) const {
+  // Far enough ahead to cover a DRAM miss at a few ns per lookup.
+  constexpr size_t kPrefetchDistance = 16;
+  CHECK(mask.empty() || mask.size() >= (in.size() + 63) / 64)
+      << "The mask has " << mask.size() << " words for " << in.size()
+      << " numbers";
+  std::fill(mask.begin(), mask.end(), 0);
+  uint64_t count = 0;
+  for (size_t i = 0; i < in.size(); ++i) {
+    if (i + kPrefetchDistance < in.size()) {
+      const uint64_t ahead = in[i + kPrefetchDistance];
+      if (ahead >= low_ && ahead <= high_) {
+        __builtin_prefetch(&notPrime_[(ahead / 30 - base_) / 8]);
+      }
+    }
+    const bool prime = isPrime(in[i]);
+    count += prime;
+    if (!mask.empty()) {
+      mask[i / 64] |= uint64_t(prime) << (i % 64);
+    }
+  }
+  return count;
+}
+
+uint64_t PrimeNumberGen::countInRange(uint64_t lo, uint64_t hi) const {
+  lo = std::max(lo, low_);
+  hi = std::min(hi, high_);
+  if (lo > hi) {
+    return 0;
+  }
+  uint64_t count = 0;
+  for (uint64_t p : {2, 3, 5}) {
+    count += lo <= p && p <= hi;
+  }
+  const uint64_t posBegin = firstPosFrom(lo);
+  const uint64_t posEnd = firstPosFrom(hi + 1);
+  if (posBegin >= posEnd) {
+    return count;
+  }
+  // Whole words in between, then the partial first and last words.
+  const uint64_t firstWord = posBegin >> 6;
+  const uint64_t lastWord = (posEnd - 1) >> 6;
+  const uint64_t* words = notPrime_.data();
+  const uint64_t headMask = ~uint64_t(0) << (posBegin & 63);
+  const uint64_t tailMask =
+      (posEnd & 63) == 0 ? ~uint64_t(0) : ~(~uint64_t(0) << (posEnd & 63));
+  if (firstWord == lastWord) {
+    return count + __builtin_popcountll(~words[firstWord] & headMask & tailMask);
+  }
+  return count + __builtin_popcountll(~words[firstWord] & headMask) +
+         countClearBits(words + firstWord + 1, words + lastWord) +
+         __builtin_popcountll(~words[lastWord] & tailMask);
+}
+
+void PrimeNumberGen::extract(uint64_t lo, uint64_t hi,
+                             std::vector<uint64_t>& out) const {
+  lo = std::max(lo, low_);
+  hi = std::min(hi, high_);
+  if (lo > hi) {
+    return;
+  }
+  // Masks of the prime bits of words [firstWord, lastWord] within the
+  // positions [posBegin, posEnd).
+  const uint64_t posBegin = firstPosFrom(lo);
+  const uint64_t posEnd = firstPosFrom(hi + 1);
+  const uint64_t firstWord = posBegin >> 6;
+  const uint64_t lastWord = (posEnd - 1) >> 6;
+  auto primeBits = [&](uint64_t wi) {
+    uint64_t bits = ~notPrime_[wi];
+    if (wi == firstWord) {
+      bits &= ~uint64_t(0) << (posBegin & 63);
+    }
+    if (wi == lastWord && (posEnd & 63) != 0) {
+      bits &= ~(~uint64_t(0) << (posEnd & 63));
+    }
+    return bits;
+  };
+
+  size_t i = out.size();
+  const size_t count = countInRange(lo, hi);
+  out.resize(i + count);
+  for (uint64_t p : {2, 3, 5}) {
+    if (lo <= p && p <= hi) {
+      out[i++] = p;
+    }
+  }
+  if (posBegin < posEnd) {
+    for (uint64_t wi = firstWord; wi <= lastWord; ++wi) {
+      // A word holds 8 bytes, i.e. 240 numbers.
+      const uint64_t wordBase = (base_ + wi * 8) * 30;
+      for (uint64_t bits = primeBits(wi); bits != 0; bits &= bits - 1) {
+        const int bit = __builtin_ctzll(bits);
+        out[i++] = wordBase + (bit >> 3) * 30 + kWheel[bit & 7];
+      }
+    }
+  }
+  DCHECK_EQ(i, out.size());
+}
+
+std::vector<uint64_t> PrimeNumberGen::toVector() const {
+  std::vector<uint64_t> primes;
+  extract(low_, high_, primes);
+  return primes;
+}
+
+size_t PrimeNumberGen::memoryBytes() const {
+  return notPrime_.size() * sizeof(uint64_t) +
+         superRank_.size() * sizeof(uint64_t) +
+         blockRank_.size() * sizeof(uint16_t) +
+         basePrimes_.capacity() * sizeof(uint64_t);
+}
+
+void PrimeNumberGen::buildRankIndex(uint64_t fromWord, int numThreads) {
+  const uint64_t numWords = notPrime_.size();
+  const uint64_t numBlocks = (numWords + kWordsPerBlock - 1) / kWordsPerBlock;
+  const uint64_t numSupers = (numWords + kWordsPerSuper - 1) / kWordsPerSuper;
+  // Superblocks before the one holding 'fromWord' keep their counts.
+  const uint64_t firstSuper = fromWord / kWordsPerSuper;
+  blockRank_.resize(numBlocks, 0);
+  superRank_.resize(numSupers + 1, 0);
+  // Superblocks are independent apart from the final prefix sum.
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+  for (uint64_t s = firstSuper; s < numSupers; ++s) {
+    uint64_t count = 0;
+    const uint64_t end = std::min((s + 1) * kWordsPerSuper, numWords);
+    for (uint64_t wi = s * kWordsPerSuper; wi < end; ++wi) {
+      if (wi % kWordsPerBlock == 0) {
+        blockRank_[wi / kWordsPerBlock] = count;
+      }
+      count += __builtin_popcountll(~notPrime_[wi]);
+    }
+    superRank_[s + 1] = count;
+  }
+  for (uint64_t s = firstSuper; s < numSupers; ++s) {
+    superRank_[s + 1] += superRank_[s];
+  }
+}
+
+uint64_t PrimeNumberGen::rank(uint64_t pos) const {
+  const uint64_t wi = pos >> 6;
+  if (wi >= notPrime_.size()) {
+    return superRank_.back();
+  }
+  uint64_t count =
+      superRank_[wi / kWordsPerSuper] + blockRank_[wi / kWordsPerBlock];
+  for (uint64_t j = wi / kWordsPerBlock * kWordsPerBlock; j < wi; ++j) {
+    count += __builtin_popcountll(~notPrime_[j]);
+  }
+  const uint64_t below = (uint64_t(1) << (pos & 63)) - 1;
+  return count + __builtin_popcountll(~notPrime_[wi] & below);
+}
+
+uint64_t PrimeNumberGen::select(uint64_t k) const {
+  // The last superblock and then the last block starting with rank <= k.
+  const uint64_t s =
+      std::upper_bound(superRank_.begin(), superRank_.end(), k) -
+      superRank_.begin() - 1;
+  k -= superRank_[s];
+  constexpr uint64_t kBlocksPerSuper = kWordsPerSuper / kWordsPerBlock;
+  const auto firstBlock = blockRank_.begin() + s * kBlocksPerSuper;
+  const auto lastBlock =
+      blockRank_.begin() +
+      std::min<uint64_t>(blockRank_.size(), (s + 1) * kBlocksPerSuper);
+  const uint64_t b =
+      std::upper_bound(firstBlock, lastBlock, k) - blockRank_.begin() - 1;
+  k -= blockRank_[b];
+  uint64_t wi = b * kWordsPerBlock;
+  for (;; ++wi) {
+    const uint64_t count = __builtin_popcountll(~notPrime_[wi]);
+    if (k < count) {
+      break;
+    }
+    k -= count;
+  }
+  // Select within the word: drop the k lowest clear bits.
+  uint64_t primes = ~notPrime_[wi];
+  for (; k > 0; --k) {
+    primes &= primes - 1;
+  }
+  return wi * 64 + __builtin_ctzll(primes);
+}
+
+uint64_t PrimeNumberGen::smallPrimesUpTo(uint64_t x) const {
+  uint64_t count = 0;
+  for (uint64_t p : {2, 3, 5}) {
+    count += low_ <= p && p <= std::min(x, high_);
+  }
+  return count;
+}
+
+uint64_t PrimeNumberGen::pi(uint64_t x) const {
+  if (x < low_) {
+    return 0;
+  }
+  x = std::min(x, high_);
+  return smallPrimesUpTo(x) + rank(firstPosFrom(x + 1));
+}
+
+uint64_t PrimeNumberGen::nthPrime(uint64_t k) const {
+  CHECK_GT(k, 0u);
+  CHECK_LE(k, pi(high_));
+  for (uint64_t p : {2, 3, 5}) {
+    if (low_ <= p && p <= high_ && --k == 0) {
+      return p;
+    }
+  }
+  return numberAt(select(k - 1));
+}
 
 uint64_t PrimeNumberGen::Itr::operator*() const { return current; }
 
 const PrimeNumberGen::Itr& PrimeNumberGen::Itr::operator++() {
-  // It will eventually hit the sentinel, high_ + 1.
-  do {
-    ++current;
-  } while (gen->isNotPrime(current));
+  if (current < 7) {
+    // Still on 2, 3 or 5, which are not on the wheel.
+    current = gen->nextPrime(current);
+    return *this;
+  }
+  const uint64_t pos = gen->nextPos(gen->bitPos(current) + 1);
+  current = pos == kNoPos ? gen->high_ + 1 : gen->numberAt(pos);
   return *this;
 }
 
@@ -53,22 +1096,72 @@ bool PrimeNumberGen::Itr::operator==(const Itr rhs) const {
 }
 
 PrimeNumberGen::Itr PrimeNumberGen::begin() const {
-  Itr b{
+  return Itr{
       .gen = this,
-      .current = low_,
+      .current = nextPrime(low_ - 1),
   };
-  // It may hit the sentinel, high_ + 1.
-  while (isNotPrime(b.current)) {
-    b.current++;
-  }
-  return b;
 }
 
 PrimeNumberGen::Itr PrimeNumberGen::end() const {
   return Itr{
       .gen = this,
-      // This is a sentinel value beyond the end and is declared a prime number
-      // (not always true).
+      // This is a sentinel value beyond the end.
       .current = high_ + 1,
   };
 }
+
+struct PrimeStream::Sieve {
+  std::vector<uint64_t> basePrimes;
+  std::vector<SievingPrime> primes;
+};
+
+PrimeStream::PrimeStream(uint64_t from)
+    : from_(std::max<uint64_t>(from, 1)), sieve_(std::make_unique<Sieve>()) {
+  for (uint64_t p : {2, 3, 5}) {
+    if (p >= from_) {
+      smallPrimes_[numSmall_++] = p;
+    }
+  }
+  segFirstByte_ = from_ / 30;
+  words_.resize(kSegmentBytes / 8);
+  sieveSegment();
+  pending_ = ~words_[0];
+  wordBase_ = segFirstByte_ * 30;
+}
+
+PrimeStream::~PrimeStream() = default;
+
+void PrimeStream::advance() {
+  if (++wordIndex_ == words_.size()) {
+    segFirstByte_ += kSegmentBytes;
+    sieveSegment();
+    wordIndex_ = 0;
+  }
+  pending_ = ~words_[wordIndex_];
+  wordBase_ = (segFirstByte_ + wordIndex_ * 8) * 30;
+}
+
+void PrimeStream::sieveSegment() {
+  const uint64_t endByte = segFirstByte_ + kSegmentBytes;
+  // Start the primes newly needed for this segment at their first multiple
+  // in it. Larger base primes are not needed yet.
+  auto& basePrimes = sieve_->basePrimes;
+  auto& primes = sieve_->primes;
+  const uint64_t known = basePrimes.size();
+  growBasePrimes(basePrimes, isqrt(endByte * 30));
+  for (uint64_t i = known; i < basePrimes.size(); ++i) {
+    if (basePrimes[i] >= kFirstSievingPrime) {
+      primes.push_back(makeSievingPrime(basePrimes[i], segFirstByte_));
+    }
+  }
+
+  auto* bytes = reinterpret_cast<uint8_t*>(words_.data());
+  preSieve(bytes, segFirstByte_, endByte);
+  crossOff(bytes, segFirstByte_, endByte, primes);
+  // Mask 1 and the numbers below 'from' in the first segment.
+  for (int i = 0; i < 8; ++i) {
+    if (segFirstByte_ * 30 + kWheel[i] < std::max<uint64_t>(from_, 2)) {
+      bytes[0] |= 1 << i;
+    }
+  }
+}
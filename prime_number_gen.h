@@ -1,33 +1,268 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
 #include <vector>
 
+#include <glog/logging.h>
+
+// Proven upper bounds: p_k <= k (ln k + ln ln k - 0.9484) for k >= 39017
+// (Dusart), p_k < k (ln k + ln ln k) for k >= 6 (Rosser), and
+// pi(x) <= x / ln x (1 + 1.2762 / ln x) for x > 1 (Dusart).
+uint64_t nthPrimeUpperBound(uint64_t k);
+uint64_t primeCountUpperBound(uint64_t x);
+
+// Deterministic Miller-Rabin test for any 64-bit n, with the 7-base set of
+// Jim Sinclair and Montgomery multiplication.
+bool isPrimeMillerRabin(uint64_t n);
+
+// How the sieve bitset is allocated. Owned arrays are always 64-byte aligned.
+struct SieveMemory {
+  // Back arrays of 2 MiB or more with huge pages: reserved ones (MAP_HUGETLB)
+  // if the system has them, transparent ones otherwise. Random lookups then
+  // miss the TLB far less often.
+  bool hugePages = false;
+  // Leave the pages untouched until the sieving threads first write them, so
+  // that on NUMA systems each chunk lands on the node of the thread that
+  // sieves it, rather than all on the node of the allocating thread.
+  bool firstTouch = false;
+};
+
+// Zero-filled memory for 'bytes' bytes under 'memory', released by
+// freeSieveMemory() with the same arguments.
+void* allocateSieveMemory(size_t bytes, SieveMemory memory);
+void freeSieveMemory(void* p, size_t bytes, SieveMemory memory);
+
+// A flat array which either owns its elements or views memory owned by
+// someone else, such as a read-only mapping of a sieve cache file.
+template <typename T>
+class SieveArray {
+public:
+  SieveArray() = default;
+  SieveArray(const SieveArray&) = delete;
+  SieveArray& operator=(const SieveArray&) = delete;
+  ~SieveArray() { release(); }
+
+  // The policy for owned storage. Set before the array owns any.
+  void setMemory(SieveMemory memory) {
+    DCHECK(owned_ == nullptr);
+    memory_ = memory;
+  }
+  const SieveMemory& memory() const { return memory_; }
+
+  void assign(size_t n, T value) {
+    release();
+    resize(n, value);
+  }
+  // Keeps the first min(n, size()) elements, copying them out of a view. The
+  // owned storage grows geometrically. New zero elements in fresh storage are
+  // not written, which leaves their pages to the first thread that uses them.
+  void resize(size_t n, T value) {
+    size_t filled = std::min(n, size_);
+    if (owned_ == nullptr || n > capacity_) {
+      const size_t capacity =
+          owned_ == nullptr ? n : std::max(n, 2 * capacity_);
+      T* grown = static_cast<T*>(
+          allocateSieveMemory(std::max<size_t>(capacity, 1) * sizeof(T),
+                              memory_));
+      std::copy(data_, data_ + filled, grown);
+      release();
+      owned_ = grown;
+      capacity_ = capacity;
+      if (value == T()) {
+        filled = n;
+      }
+    }
+    std::fill(owned_ + filled, owned_ + n, value);
+    data_ = owned_;
+    size_ = n;
+  }
+  void view(const T* data, size_t n) {
+    release();
+    data_ = const_cast<T*>(data);
+    size_ = n;
+  }
+
+  // Only owned arrays may be written.
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+  T& operator[](size_t i) { return data_[i]; }
+  const T& operator[](size_t i) const { return data_[i]; }
+  size_t size() const { return size_; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+  const T& back() const { return data_[size_ - 1]; }
+
+private:
+  void release() {
+    if (owned_ != nullptr) {
+      freeSieveMemory(owned_, std::max<size_t>(capacity_, 1) * sizeof(T),
+                      memory_);
+    }
+    owned_ = data_ = nullptr;
+    capacity_ = size_ = 0;
+  }
+
+  SieveMemory memory_;
+  T* owned_ = nullptr;
+  size_t capacity_ = 0;
+  T* data_ = nullptr;
+  size_t size_ = 0;
+};
+
 class PrimeNumberGen {
 private:
-  std::vector<uint64_t> notPrime_; // bit vector
+  // Mod-30 wheel bitset. Byte b stands for the 30 numbers starting at
+  // 30 * (base_ + b); its 8 bits are the residues coprime to 30 (kWheel), so
+  // multiples of 2, 3 and 5 take no space. A set bit means not prime or
+  // outside [low_, high_]. Bytes are packed little-endian into the words.
+  SieveArray<uint64_t> notPrime_;
   uint64_t low_, high_;
+  uint64_t base_; // low_ / 30
+  // The sieving primes up to sqrt(high_), kept for extendTo().
+  std::vector<uint64_t> basePrimes_;
 
+  // The number of bytes covering [30 * base_, high_].
+  uint64_t numBytes() const { return high_ / 30 - base_ + 1; }
+  // Sieves the bytes from 'firstByte' to the end of the table.
+  void sieve(uint64_t firstByte, int numThreads);
+  // Sets the bits outside [low_, high_] and the padding of the last word.
+  void maskOutOfRange();
 
- // Helper methods for bit manipulation
- static constexpr uint64_t wordIndex(uint64_t n) { return n >> 6; }
- static constexpr uint64_t bitIndex(uint64_t n) { return n & 63; }
- void setNotPrime(uint64_t n) {
-   notPrime_[wordIndex(n)] |= (1ULL << bitIndex(n));
- }
+  // Rank index over the wheel bits: the number of clear bits before every
+  // superblock of kWordsPerSuper words, and before every block of
+  // kWordsPerBlock words relative to its superblock. About 3% of the bitset.
+  static constexpr uint64_t kWordsPerBlock = 8;
+  static constexpr uint64_t kWordsPerSuper = 1024;
+  SieveArray<uint64_t> superRank_;
+  SieveArray<uint16_t> blockRank_;
+  // Recomputes the index from the superblock holding 'fromWord' on, using
+  // 'numThreads' OpenMP threads.
+  void buildRankIndex(uint64_t fromWord, int numThreads);
+  // The number of clear bits in [0, pos).
+  uint64_t rank(uint64_t pos) const;
+  // The position of the clear bit with 0-based rank k.
+  uint64_t select(uint64_t k) const;
+  // The number of 2, 3 and 5 in [low_, min(x, high_)].
+  uint64_t smallPrimesUpTo(uint64_t x) const;
+
+  // The read-only mapping of a cache file the arrays above point into.
+  void* mapping_ = nullptr;
+  size_t mappingBytes_ = 0;
+  PrimeNumberGen() = default;
+
+  // Bit position of n in the bitset. n must be coprime to 30.
+  uint64_t bitPos(uint64_t n) const {
+    return (n / 30 - base_) * 8 + kResidueBit[n % 30];
+  }
+  // The number at bit position 'pos'.
+  uint64_t numberAt(uint64_t pos) const {
+    return (base_ + pos / 8) * 30 + kWheel[pos % 8];
+  }
+  bool testBit(uint64_t pos) const {
+    return (notPrime_[pos >> 6] >> (pos & 63)) & 1;
+  }
+  // The first bit position whose number is >= n. n must be >= 30 * base_.
+  uint64_t firstPosFrom(uint64_t n) const;
+  static constexpr uint64_t kNoPos = ~uint64_t(0);
+  // The first clear bit at or after 'pos', or kNoPos if there is none.
+  uint64_t nextPos(uint64_t pos) const;
+  // The smallest prime in (n, high_], or high_ + 1 if there is none.
+  uint64_t nextPrime(uint64_t n) const;
 
 public:
-  PrimeNumberGen(uint64_t low, uint64_t high);
+  // Numbers coprime to 30 in [0, 30), one per bit of a byte.
+  static constexpr std::array<uint64_t, 8> kWheel = {1, 7, 11, 13, 17, 19, 23, 29};
+  // The bit of residue r in a byte, -1 if r is not coprime to 30.
+  static constexpr std::array<int8_t, 30> kResidueBit = [] {
+    std::array<int8_t, 30> bits{};
+    bits.fill(-1);
+    for (int i = 0; i < 8; ++i) {
+      bits[kWheel[i]] = i;
+    }
+    return bits;
+  }();
+
+  // Sieves [low, high] on 'numThreads' OpenMP threads into a bitset allocated
+  // under 'memory'. The table is the same for any thread count and policy.
+  PrimeNumberGen(uint64_t low, uint64_t high, int numThreads = 1,
+                 SieveMemory memory = {});
   ~PrimeNumberGen();
+
+  // Grows the table to [low, newHigh], sieving only the new numbers with the
+  // stored base primes. Iterators and results for the old range stay valid.
+  // The bitset grows geometrically, so repeated extensions cost O(final size).
+  void extendTo(uint64_t newHigh, int numThreads = 1);
+
+  // Writes the table and its rank index to 'path' as a versioned image with
+  // a header (range, layout, checksum). The file is written next to 'path'
+  // and renamed into place, so concurrent readers never see a partial image.
+  void save(const std::string& path) const;
+  // Maps an image written by save() read-only. Processes loading the same
+  // image share its pages. Returns nullptr if the file is missing or does not
+  // match this layout. 'verifyChecksum' reads every page up front.
+  static std::unique_ptr<PrimeNumberGen> load(const std::string& path,
+                                              bool verifyChecksum = false);
+  // Loads the image of [low, high] from 'cacheDir', or sieves it and saves
+  // the image there for the next run. An empty 'cacheDir' just sieves.
+  // 'memory' applies to a sieved table only; a loaded one is a file mapping.
+  static std::unique_ptr<PrimeNumberGen> cached(const std::string& cacheDir,
+                                                uint64_t low, uint64_t high,
+                                                int numThreads = 1,
+                                                SieveMemory memory = {});
+  // A table starting at 'minValue' that holds at least k primes. When
+  // 'minValue' is small compared to the k-th prime, the bounds above are tight
+  // and size it in a single sieve. Otherwise it is grown with extendTo() from
+  // about the average span of k primes, at most doubling past the k-th prime.
+  static std::unique_ptr<PrimeNumberGen> forFirstKPrimes(uint64_t k,
+                                                         uint64_t minValue,
+                                                         int numThreads = 1);
   PrimeNumberGen(const PrimeNumberGen&) = delete;
   PrimeNumberGen& operator=(const PrimeNumberGen&) = delete;
   PrimeNumberGen(PrimeNumberGen&&) = delete;
   PrimeNumberGen& operator=(PrimeNumberGen&&) = delete;
 
-  bool isNotPrime(uint64_t n) const {
-    return (notPrime_[wordIndex(n)] >> bitIndex(n)) & 1;
+  // A table lookup for n in [low, high], Miller-Rabin otherwise.
+  bool isPrime(uint64_t n) const {
+    if (n < low_ || n > high_) {
+      return isPrimeMillerRabin(n);
+    }
+    if (n < 7) {
+      return n == 2 || n == 3 || n == 5;
+    }
+    const int bit = kResidueBit[n % 30];
+    return bit >= 0 && !testBit((n / 30 - base_) * 8 + bit);
   }
-  bool isPrime(uint64_t n) const { return !isNotPrime(n); }
+  bool isNotPrime(uint64_t n) const { return !isPrime(n); }
+  // isPrime() for every number of 'in', returning how many are prime. The
+  // table words are prefetched several lookups ahead, so the cache misses of
+  // scattered numbers overlap. If 'mask' is not empty, bit i % 64 of mask[i /
+  // 64] is set exactly when in[i] is prime; it needs (in.size() + 63) / 64
+  // words.
+  uint64_t isPrimeBatch(std::span<const uint64_t> in,
+                        std::span<uint64_t> mask = {}) const;
+
+  // The number of primes in [lo, hi] that are also in [low, high], by a
+  // popcount over the bitset words covering them rather than the rank index.
+  // O((hi - lo) / 240).
+  uint64_t countInRange(uint64_t lo, uint64_t hi) const;
+  // Appends the primes in [lo, hi] that are also in [low, high] to 'out' in
+  // increasing order. A popcount pass sizes 'out' exactly before it is filled.
+  void extract(uint64_t lo, uint64_t hi, std::vector<uint64_t>& out) const;
+  // All primes in [low, high].
+  std::vector<uint64_t> toVector() const;
+  // Bytes held by the bitset, its rank index and the sieving primes.
+  size_t memoryBytes() const;
+
+  // The number of primes in [low, x]; pi(x) when low <= 2. O(1).
+  uint64_t pi(uint64_t x) const;
+  // The k-th (1-based) prime in [low, high]. 'k' must be at most pi(high).
+  // O(log(high - low)).
+  uint64_t nthPrime(uint64_t k) const;
 
   struct Itr {
     const PrimeNumberGen* gen = nullptr;
@@ -41,3 +276,57 @@ public:
   Itr begin() const;
   Itr end() const;
 };
+
+// The k-th (1-based) prime, from one sieve of near-minimal size.
+uint64_t nthPrime(uint64_t k, int numThreads = 1);
+// The first k primes >= minValue.
+std::vector<uint64_t> firstKPrimes(uint64_t k, uint64_t minValue = 2,
+                                   int numThreads = 1);
+// pi(x) without a table up to x, by the Lucy_Hedgehog recurrence over the
+// O(sqrt(x)) distinct values of x / i: O(x^(3/4) / log x) time and O(sqrt(x))
+// memory, about 2 s for x = 1e12 on one core. Each round runs on 'numThreads'.
+uint64_t countPrimes(uint64_t x, int numThreads = 1);
+
+// The primes from 'from' on in increasing order, with no upper bound. One
+// cache-sized segment is sieved at a time and the sieving primes grow with
+// the position, so memory is O(sqrt(x)) at the current prime x.
+class PrimeStream {
+public:
+  explicit PrimeStream(uint64_t from = 2);
+  ~PrimeStream();
+  PrimeStream(const PrimeStream&) = delete;
+  PrimeStream& operator=(const PrimeStream&) = delete;
+
+  uint64_t next() {
+    if (nextSmall_ < numSmall_) {
+      return smallPrimes_[nextSmall_++];
+    }
+    while (pending_ == 0) {
+      advance();
+    }
+    const int bit = __builtin_ctzll(pending_);
+    pending_ &= pending_ - 1;
+    return wordBase_ + (bit >> 3) * 30 + PrimeNumberGen::kWheel[bit & 7];
+  }
+
+private:
+  // Loads the next word, sieving the next segment when this one is used up.
+  void advance();
+  // Sieves the segment starting at byte segFirstByte_ into words_.
+  void sieveSegment();
+
+  // 2, 3 and 5 are not on the wheel.
+  uint64_t smallPrimes_[3];
+  int numSmall_ = 0, nextSmall_ = 0;
+  uint64_t from_;
+  // The current segment in the PrimeNumberGen wheel layout, and the prime
+  // bits of the current word not returned yet.
+  std::vector<uint64_t> words_;
+  uint64_t segFirstByte_ = 0;
+  size_t wordIndex_ = 0;
+  uint64_t pending_ = 0;
+  uint64_t wordBase_ = 0;
+  // The base and sieving primes.
+  struct Sieve;
+  std::unique_ptr<Sieve> sieve_;
+};
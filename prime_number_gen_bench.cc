@@ -0,0 +1,250 @@
+#include "prime_number_gen.h"
+#include "prime_list.h"
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Benchmarks for PrimeNumberGen and friends. Range arguments are powers of
+// ten. Run them with `make bench` and compare two JSON outputs with
+// compare.py from google/benchmark.
+
+namespace {
+
+uint64_t pow10(int64_t exponent) {
+  return static_cast<uint64_t>(std::pow(10.0, exponent));
+}
+
+// A reproducible stream of pseudo-random numbers below 'limit'.
+class RandomNumbers {
+public:
+  explicit RandomNumbers(uint64_t limit) : limit_(limit) {}
+  uint64_t next() {
+    x_ = x_ * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (x_ >> 20) % limit_;
+  }
+
+private:
+  uint64_t limit_;
+  uint64_t x_ = 12345;
+};
+
+// The footprint of the table as a counter, in bytes.
+void setMemoryCounter(benchmark::State& state, size_t bytes) {
+  state.counters["bytes"] =
+      benchmark::Counter(bytes, benchmark::Counter::kDefaults,
+                         benchmark::Counter::kIs1024);
+}
+
+} // namespace
+
+static void BM_PrimeGenConstruction(benchmark::State& state) {
+  const uint64_t high = pow10(state.range(0));
+  size_t bytes = 0;
+  for (auto _ : state) {
+    PrimeNumberGen pg(1, high);
+    bytes = pg.memoryBytes();
+    benchmark::DoNotOptimize(pg);
+  }
+  setMemoryCounter(state, bytes);
+  state.SetItemsProcessed(state.iterations() * high);
+}
+BENCHMARK(BM_PrimeGenConstruction)
+    ->ArgName("log10")
+    ->DenseRange(7, 10)
+    ->Unit(benchmark::kMillisecond);
+
+// A window of 10^range(1) numbers starting at 10^range(0). The sieving primes
+// go up to sqrt(1e11) ~ 3.2e5, sqrt(1e12) = 1e6 and sqrt(1e13) ~ 3.2e6, so
+// most of them hit a 32 KiB segment at most once.
+static void BM_PrimeGenWindow(benchmark::State& state) {
+  const uint64_t low = pow10(state.range(0));
+  const uint64_t width = pow10(state.range(1));
+  size_t bytes = 0;
+  for (auto _ : state) {
+    PrimeNumberGen pg(low, low + width);
+    bytes = pg.memoryBytes();
+    benchmark::DoNotOptimize(pg);
+  }
+  setMemoryCounter(state, bytes);
+  state.SetItemsProcessed(state.iterations() * width);
+}
+BENCHMARK(BM_PrimeGenWindow)
+    ->ArgNames({"low", "width"})
+    ->ArgsProduct({{11, 12, 13}, {7, 9}})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_PrimeGenConstructionThreads(benchmark::State& state) {
+  for (auto _ : state) {
+    PrimeNumberGen pg(1, 1'000'000'000ULL, state.range(0));
+    benchmark::DoNotOptimize(pg);
+  }
+}
+BENCHMARK(BM_PrimeGenConstructionThreads)
+    ->ArgName("threads")
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_PrimeGenIteration(benchmark::State& state) {
+  PrimeNumberGen pg(1, pow10(state.range(0)));
+  uint64_t count = 0;
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    for (auto p : pg) {
+      sum += p;
+      ++count;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(count);
+}
+BENCHMARK(BM_PrimeGenIteration)
+    ->ArgName("log10")
+    ->DenseRange(8, 9)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_PrimeGenToVector(benchmark::State& state) {
+  PrimeNumberGen pg(1, pow10(state.range(0)));
+  uint64_t count = 0;
+  for (auto _ : state) {
+    auto primes = pg.toVector();
+    benchmark::DoNotOptimize(primes.data());
+    count += primes.size();
+  }
+  state.SetItemsProcessed(count);
+}
+BENCHMARK(BM_PrimeGenToVector)
+    ->ArgName("log10")
+    ->DenseRange(8, 9)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_PrimeGenRankSelect(benchmark::State& state) {
+  const uint64_t high = pow10(state.range(0));
+  PrimeNumberGen pg(1, high);
+  const uint64_t total = pg.pi(high);
+  RandomNumbers random(high);
+  for (auto _ : state) {
+    const uint64_t x = random.next();
+    benchmark::DoNotOptimize(pg.pi(x));
+    benchmark::DoNotOptimize(pg.nthPrime(x % total + 1));
+  }
+}
+BENCHMARK(BM_PrimeGenRankSelect)->ArgName("log10")->DenseRange(8, 9);
+
+// Random isPrime() latency. A 1e8 table fits in the last level cache, a 1e10
+// one spans 333 MB of bitset.
+static void BM_PrimeGenRandomLookup(benchmark::State& state) {
+  const uint64_t high = pow10(state.range(0));
+  PrimeNumberGen pg(1, high, 1, SieveMemory{.hugePages = state.range(1) != 0});
+  RandomNumbers random(high);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(pg.isPrime(random.next()));
+  }
+  setMemoryCounter(state, pg.memoryBytes());
+}
+BENCHMARK(BM_PrimeGenRandomLookup)
+    ->ArgNames({"log10", "hugePages"})
+    ->ArgsProduct({{8, 10}, {0, 1}});
+
+// The same lookups through isPrimeBatch().
+static void BM_PrimeGenRandomLookupBatch(benchmark::State& state) {
+  const uint64_t high = pow10(state.range(0));
+  PrimeNumberGen pg(1, high, 1, SieveMemory{.hugePages = state.range(1) != 0});
+  RandomNumbers random(high);
+  std::vector<uint64_t> in(4096);
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (auto& n : in) {
+      n = random.next();
+    }
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(pg.isPrimeBatch(in));
+  }
+  state.SetItemsProcessed(state.iterations() * in.size());
+}
+BENCHMARK(BM_PrimeGenRandomLookupBatch)
+    ->ArgNames({"log10", "hugePages"})
+    ->ArgsProduct({{8, 10}, {0, 1}});
+
+static void BM_CountPrimes(benchmark::State& state) {
+  const uint64_t x = pow10(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(countPrimes(x));
+  }
+}
+BENCHMARK(BM_CountPrimes)
+    ->ArgName("log10")
+    ->DenseRange(11, 13)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_MillerRabin(benchmark::State& state) {
+  RandomNumbers random(~uint64_t(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(isPrimeMillerRabin(random.next() | 1));
+  }
+}
+BENCHMARK(BM_MillerRabin);
+
+static void BM_PrimeGenLoadCache(benchmark::State& state) {
+  const std::string path =
+      "/tmp/bm_primes_" + std::to_string(getpid()) + ".sieve";
+  PrimeNumberGen(1, 1'000'000'000ULL).save(path);
+  for (auto _ : state) {
+    auto pg = PrimeNumberGen::load(path);
+    benchmark::DoNotOptimize(pg->pi(1'000'000'000ULL));
+  }
+  std::remove(path.c_str());
+}
+BENCHMARK(BM_PrimeGenLoadCache)->Unit(benchmark::kMillisecond);
+
+static void BM_PrimeStream(benchmark::State& state) {
+  const uint64_t high = pow10(state.range(0));
+  for (auto _ : state) {
+    PrimeStream stream;
+    uint64_t sum = 0;
+    for (uint64_t p = stream.next(); p <= high; p = stream.next()) {
+      sum += p;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+}
+BENCHMARK(BM_PrimeStream)
+    ->ArgName("log10")
+    ->DenseRange(8, 9)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_PrimeListScan(benchmark::State& state) {
+  PrimeNumberGen pg(1, 1'000'000'000ULL);
+  const PrimeList list(pg);
+  setMemoryCounter(state, list.memoryBytes());
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    for (auto p : list) {
+      sum += p;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * list.size());
+}
+BENCHMARK(BM_PrimeListScan)->Unit(benchmark::kMillisecond);
+
+static void BM_PrimeVectorScan(benchmark::State& state) {
+  PrimeNumberGen pg(1, 1'000'000'000ULL);
+  const auto primes = pg.toVector();
+  setMemoryCounter(state, primes.size() * sizeof(uint64_t));
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    for (auto p : primes) {
+      sum += p;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * primes.size());
+}
+BENCHMARK(BM_PrimeVectorScan)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -1,8 +1,12 @@
 #include "prime_number_gen.h"
+#include "prime_list.h"
+#include "small_primes.h"
 #include <gtest/gtest.h>
-#include <benchmark/benchmark.h>
 #include <vector>
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
 
 // Tests
 TEST(PrimeNumberGenTest, SmallRange) {
@@ -47,30 +51,441 @@ TEST(PrimeNumberGenTest, LargeRangeCount) {
     EXPECT_EQ(count, 9592);
 }
 
-// Benchmarks
-static void BM_PrimeGenConstruction(benchmark::State& state) {
-  for (auto _ : state) {
-    PrimeNumberGen pg(1, 1'000'000'000ULL);
-    benchmark::DoNotOptimize(pg);
-  }
+TEST(PrimeNumberGenTest, MatchesPlainSieveAcrossBlocks) {
+    // Spans several sieve blocks so that multiples carried between blocks are
+    // checked against a straightforward sieve.
+    const uint64_t high = 1'000'003;
+    std::vector<bool> composite(high + 1, false);
+    composite[0] = composite[1] = true;
+    for (uint64_t p = 2; p * p <= high; ++p) {
+        if (!composite[p]) {
+            for (uint64_t n = p * p; n <= high; n += p) {
+                composite[n] = true;
+            }
+        }
+    }
+    PrimeNumberGen pg(1, high);
+    for (uint64_t n = 1; n <= high; ++n) {
+        ASSERT_EQ(pg.isPrime(n), !composite[n]) << n;
+    }
+}
+
+TEST(PrimeNumberGenTest, SmallWindowsOnTheWheel) {
+    // Windows starting and ending at every residue mod 30, including 2, 3 and
+    // 5 which are not on the wheel.
+    PrimeNumberGen full(1, 400);
+    for (uint64_t low = 1; low <= 70; ++low) {
+        for (uint64_t high = low + 1; high <= 400; high += 7) {
+            PrimeNumberGen pg(low, high);
+            std::vector<uint64_t> primes, expected;
+            for (auto p : pg) {
+                primes.push_back(p);
+            }
+            for (uint64_t n = low; n <= high; ++n) {
+                ASSERT_EQ(pg.isPrime(n), full.isPrime(n)) << n;
+                if (full.isPrime(n)) {
+                    expected.push_back(n);
+                }
+            }
+            ASSERT_EQ(primes, expected) << low << " " << high;
+        }
+    }
+}
+
+TEST(PrimeNumberGenTest, WindowMatchesFullSieve) {
+    PrimeNumberGen full(1, 1'100'000);
+    PrimeNumberGen window(1'000'000, 1'100'000);
+    for (uint64_t n = 1'000'000; n <= 1'100'000; ++n) {
+        ASSERT_EQ(window.isPrime(n), full.isPrime(n)) << n;
+    }
+}
+
+TEST(PrimeNumberGenTest, NarrowWindowNearTrillion) {
+    // Only ~1M bits are stored for a window that starts at 1e12.
+    PrimeNumberGen pg(1'000'000'000'000ULL, 1'000'001'000'000ULL);
+    std::vector<uint64_t> first;
+    int count = 0;
+    for (auto p : pg) {
+        if (first.size() < 3) {
+            first.push_back(p);
+        }
+        count++;
+    }
+    std::vector<uint64_t> expected = {1'000'000'000'039ULL, 1'000'000'000'061ULL,
+                                      1'000'000'000'063ULL};
+    EXPECT_EQ(first, expected);
+    EXPECT_EQ(count, 36249);
+}
+
+TEST(PrimeNumberGenTest, ThreadCountDoesNotChangeTable) {
+    const uint64_t low = 999'983, high = 20'000'000;
+    PrimeNumberGen serial(low, high);
+    for (int numThreads : {2, 3, 8}) {
+        PrimeNumberGen parallel(low, high, numThreads);
+        for (uint64_t n = low; n <= high; ++n) {
+            ASSERT_EQ(parallel.isPrime(n), serial.isPrime(n)) << n << " " << numThreads;
+        }
+    }
+}
+
+TEST(PrimeNumberGenTest, MemoryPolicyDoesNotChangeTable) {
+    const uint64_t low = 999'983, high = 200'000'000;
+    PrimeNumberGen plain(low, high);
+    PrimeNumberGen next(high + 1, high + 1'000'000);
+    for (SieveMemory memory : {SieveMemory{.hugePages = true},
+                               SieveMemory{.firstTouch = true},
+                               SieveMemory{.hugePages = true, .firstTouch = true}}) {
+        PrimeNumberGen pg(low, high, 3, memory);
+        EXPECT_EQ(pg.toVector(), plain.toVector());
+        pg.extendTo(high + 1'000'000);
+        EXPECT_EQ(pg.pi(high + 1'000'000) - pg.pi(high), next.pi(high + 1'000'000))
+            << memory.hugePages << memory.firstTouch;
+    }
+}
+
+TEST(PrimeNumberGenTest, CountPrimesWithoutTable) {
+    PrimeNumberGen pg(1, 100'000);
+    for (uint64_t x = 0; x <= 100'000; x += x < 1'000 ? 1 : 997) {
+        ASSERT_EQ(countPrimes(x), x < 2 ? 0 : pg.pi(x)) << x;
+    }
+    EXPECT_EQ(countPrimes(10'000'000) - countPrimes(999'999), 586'081u);
+    EXPECT_EQ(countPrimes(10'000'000'000ULL, 3), 455'052'511u);
+    EXPECT_EQ(countPrimes(1'000'000'000'000ULL), 37'607'912'018u);
+    // A perfect square, 1000001^2.
+    PrimeNumberGen window(1'000'000'000'000ULL, 1'000'002'000'001ULL);
+    EXPECT_EQ(countPrimes(1'000'002'000'001ULL),
+              37'607'912'018u + window.pi(1'000'002'000'001ULL));
+}
+
+template <uint64_t N>
+void expectSmallPrimesMatch() {
+    static_assert(kSmallPrimes<N>.size() == kSmallPrimeSieve<N>.count());
+    std::vector<uint64_t> expected;
+    if (N > 2) {
+        expected = PrimeNumberGen(1, N - 1).toVector();
+    }
+    EXPECT_EQ(std::vector<uint64_t>(kSmallPrimes<N>.begin(), kSmallPrimes<N>.end()),
+              expected) << N;
+    for (uint64_t n = 0; n < N; ++n) {
+        ASSERT_EQ(kSmallPrimeSieve<N>.isPrime(n),
+                  std::binary_search(expected.begin(), expected.end(), n)) << n;
+    }
+}
+
+TEST(SmallPrimesTest, MatchesPrimeNumberGen) {
+    static_assert(kSmallPrimeSieve<1'000>.isPrime(997));
+    static_assert(!kSmallPrimeSieve<1'000>.isPrime(999));
+    static_assert(kSmallPrimes<100>.size() == 25 && kSmallPrimes<100>.back() == 97);
+    expectSmallPrimesMatch<2>();
+    expectSmallPrimesMatch<3>();
+    expectSmallPrimesMatch<128>();
+    expectSmallPrimesMatch<129>();
+    expectSmallPrimesMatch<4'097>();
+    expectSmallPrimesMatch<65'536>();
+    expectSmallPrimesMatch<100'003>();
+}
+
+TEST(PrimeNumberGenTest, CountInRangeMatchesPi) {
+    PrimeNumberGen pg(1'000, 3'000'000);
+    uint64_t x = 12345;
+    for (int i = 0; i < 2'000; ++i) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        const uint64_t lo = (x >> 20) % 3'100'000;
+        const uint64_t hi = lo + (x >> 50) % (i % 2 ? 100'000 : 500);
+        const uint64_t expected =
+            hi < lo || hi < 1'000 ? 0 : pg.pi(hi) - (lo > 1'000 ? pg.pi(lo - 1) : 0);
+        ASSERT_EQ(pg.countInRange(lo, hi), expected) << lo << " " << hi;
+    }
+    EXPECT_EQ(pg.countInRange(1'000, 3'000'000), pg.pi(3'000'000));
+    EXPECT_EQ(pg.countInRange(2, 999), 0u);
+}
+
+TEST(PrimeNumberGenTest, IsPrimeBatch) {
+    PrimeNumberGen pg(1'000, 3'000'000);
+    std::vector<uint64_t> in = {0, 1, 2, 5, 7, 999, 1'009, 2'999'999, 3'000'017,
+                                1'000'000'007ULL, 1'000'000'009ULL * 7};
+    uint64_t x = 12345;
+    for (int i = 0; i < 1'000; ++i) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        in.push_back((x >> 20) % 3'100'000);
+    }
+    std::vector<uint64_t> mask((in.size() + 63) / 64, ~0ULL);
+    uint64_t expected = 0;
+    for (auto n : in) {
+        expected += pg.isPrime(n);
+    }
+    EXPECT_EQ(pg.isPrimeBatch(in, mask), expected);
+    EXPECT_EQ(pg.isPrimeBatch(in), expected);
+    for (size_t i = 0; i < in.size(); ++i) {
+        ASSERT_EQ((mask[i / 64] >> (i % 64)) & 1, pg.isPrime(in[i])) << in[i];
+    }
+    EXPECT_EQ(pg.isPrimeBatch({}), 0u);
+}
+
+TEST(PrimeNumberGenTest, ExtractMatchesIterator) {
+    PrimeNumberGen pg(1'000, 200'000);
+    std::vector<uint64_t> all;
+    for (auto p : pg) {
+        all.push_back(p);
+    }
+    EXPECT_EQ(pg.toVector(), all);
+    for (uint64_t lo : {1ULL, 999ULL, 1'000ULL, 1'009ULL, 31'337ULL}) {
+        for (uint64_t hi : {1'000ULL, 1'009ULL, 1'240ULL, 65'536ULL, 300'000ULL}) {
+            std::vector<uint64_t> out = {42}, expected = {42};
+            pg.extract(lo, hi, out);
+            for (auto p : all) {
+                if (lo <= p && p <= hi) {
+                    expected.push_back(p);
+                }
+            }
+            EXPECT_EQ(out, expected) << lo << " " << hi;
+        }
+    }
+    PrimeNumberGen small(2, 12);
+    EXPECT_EQ(small.toVector(), std::vector<uint64_t>({2, 3, 5, 7, 11}));
+}
+
+TEST(PrimeNumberGenTest, RankAndSelect) {
+    PrimeNumberGen pg(1, 1000);
+    EXPECT_EQ(pg.pi(1), 0u);
+    EXPECT_EQ(pg.pi(2), 1u);
+    EXPECT_EQ(pg.pi(30), 10u);
+    EXPECT_EQ(pg.pi(1000), 168u);
+    EXPECT_EQ(pg.pi(5000), 168u);
+    EXPECT_EQ(pg.nthPrime(1), 2u);
+    EXPECT_EQ(pg.nthPrime(168), 997u);
+
+    PrimeNumberGen window(1'000'000, 10'000'000);
+    EXPECT_EQ(window.pi(999'999), 0u);
+    EXPECT_EQ(window.pi(10'000'000), 586'081u);
+
+    // Spans several superblocks of the index.
+    PrimeNumberGen large(7, 50'000'000);
+    const auto primes = large.toVector();
+    for (size_t i = 0; i < primes.size(); i += 997) {
+        ASSERT_EQ(large.nthPrime(i + 1), primes[i]) << i;
+        ASSERT_EQ(large.pi(primes[i]), i + 1) << i;
+        ASSERT_EQ(large.pi(primes[i] - 1), i) << i;
+    }
+    EXPECT_EQ(large.nthPrime(primes.size()), primes.back());
+}
+
+TEST(PrimeNumberGenTest, MillerRabin) {
+    PrimeNumberGen pg(1, 1'000'000);
+    for (uint64_t n = 0; n <= 1'000'000; ++n) {
+        ASSERT_EQ(isPrimeMillerRabin(n), n > 0 && pg.isPrime(n)) << n;
+    }
+    // Strong pseudoprimes to several small bases.
+    EXPECT_FALSE(isPrimeMillerRabin(3'215'031'751ULL));
+    EXPECT_FALSE(isPrimeMillerRabin(3'825'123'056'546'413'051ULL));
+    EXPECT_FALSE(isPrimeMillerRabin(1'000'000'007ULL * 998'244'353ULL));
+    EXPECT_TRUE(isPrimeMillerRabin(1'000'000'000'039ULL));
+    EXPECT_TRUE(isPrimeMillerRabin((1ULL << 61) - 1));
+    EXPECT_TRUE(isPrimeMillerRabin(18'446'744'073'709'551'557ULL));
+    EXPECT_FALSE(isPrimeMillerRabin(18'446'744'073'709'551'615ULL));
+
+    // Outside the sieved range isPrime falls back to Miller-Rabin.
+    PrimeNumberGen window(1'000, 2'000);
+    EXPECT_TRUE(window.isPrime(7));
+    EXPECT_FALSE(window.isPrime(999));
+    EXPECT_TRUE(window.isPrime(1'009));
+    EXPECT_TRUE(window.isPrime(1'000'000'000'061ULL));
+    EXPECT_FALSE(window.isPrime(1'000'000'000'063ULL * 3));
 }
-BENCHMARK(BM_PrimeGenConstruction)->Unit(benchmark::kMillisecond);
 
-static void BM_PrimeGenConstructionLarge(benchmark::State& state) {
-  for (auto _ : state) {
-    PrimeNumberGen pg(1, 10'000'000'000ULL);
-    benchmark::DoNotOptimize(pg);
-  }
+TEST(PrimeNumberGenTest, SaveAndLoadCache) {
+    const std::string path =
+        testing::TempDir() + "/primes_" + std::to_string(getpid()) + ".sieve";
+    PrimeNumberGen built(1'000'000, 10'000'000);
+    built.save(path);
+
+    auto loaded = PrimeNumberGen::load(path, /*verifyChecksum=*/true);
+    ASSERT_NE(loaded, nullptr);
+    EXPECT_EQ(loaded->toVector(), built.toVector());
+    EXPECT_EQ(loaded->pi(10'000'000), 586'081u);
+    EXPECT_EQ(loaded->nthPrime(1'000), built.nthPrime(1'000));
+
+    // An image with trailing bytes is rejected, and so is a truncated one.
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out << "x";
+    }
+    EXPECT_EQ(PrimeNumberGen::load(path), nullptr);
+    ASSERT_EQ(truncate(path.c_str(), 4096), 0);
+    EXPECT_EQ(PrimeNumberGen::load(path), nullptr);
+
+    // A header whose range disagrees with its counts is rejected even though
+    // the file size matches the counts.
+    built.save(path);
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        const uint64_t high = 20'000'000;
+        file.seekp(24); // magic, version, wheel, low
+        file.write(reinterpret_cast<const char*>(&high), sizeof high);
+    }
+    EXPECT_EQ(PrimeNumberGen::load(path), nullptr);
+    std::remove(path.c_str());
+    EXPECT_EQ(PrimeNumberGen::load(path), nullptr);
+
+    auto first = PrimeNumberGen::cached(testing::TempDir(), 1'000, 2'000);
+    auto second = PrimeNumberGen::cached(testing::TempDir(), 1'000, 2'000);
+    EXPECT_EQ(first->toVector(), second->toVector());
+    std::remove((testing::TempDir() + "/primes_1000_2000.sieve").c_str());
+}
+
+TEST(PrimeNumberGenTest, ExtendTo) {
+    PrimeNumberGen pg(7, 100);
+    auto it = pg.begin();
+    EXPECT_EQ(*it, 7u);
+    // Small steps re-sieve a partial last byte, large ones add new blocks and
+    // base primes.
+    for (uint64_t high : {101ULL, 131ULL, 1'000ULL, 123'457ULL, 5'000'000ULL}) {
+        pg.extendTo(high);
+        PrimeNumberGen fresh(7, high);
+        EXPECT_EQ(pg.toVector(), fresh.toVector()) << high;
+        EXPECT_EQ(pg.pi(high), fresh.pi(high)) << high;
+    }
+    ++it;
+    EXPECT_EQ(*it, 11u);
+    EXPECT_TRUE(pg.isPrime(4'999'999));
+    EXPECT_EQ(pg.nthPrime(pg.pi(5'000'000)), 4'999'999u);
+
+    // An image mapped from a cache file is copied before it grows.
+    const std::string path =
+        testing::TempDir() + "/extend_" + std::to_string(getpid()) + ".sieve";
+    PrimeNumberGen(1'000'000, 2'000'000).save(path);
+    auto loaded = PrimeNumberGen::load(path);
+    std::remove(path.c_str());
+    ASSERT_NE(loaded, nullptr);
+    loaded->extendTo(10'000'000, 4);
+    EXPECT_EQ(loaded->pi(10'000'000), 586'081u);
+}
+
+TEST(PrimeNumberGenTest, NthPrimeBounds) {
+    PrimeNumberGen pg(1, 3'000'000);
+    const auto primes = pg.toVector();
+    for (uint64_t k = 1; k <= primes.size(); ++k) {
+        ASSERT_GE(nthPrimeUpperBound(k), primes[k - 1]) << k;
+        ASSERT_GE(primeCountUpperBound(primes[k - 1]), k) << k;
+    }
+    // The bound stays within a few percent of p_k.
+    EXPECT_LT(nthPrimeUpperBound(primes.size()), primes.back() * 1.02);
+
+    EXPECT_EQ(nthPrime(1), 2u);
+    EXPECT_EQ(nthPrime(168), 997u);
+    EXPECT_EQ(nthPrime(1'000'000, 4), 15'485'863u);
+    EXPECT_EQ(firstKPrimes(5, 3), std::vector<uint64_t>({3, 5, 7, 11, 13}));
+    EXPECT_EQ(firstKPrimes(3, 1'000'000'000'000ULL),
+              std::vector<uint64_t>({1'000'000'000'039ULL, 1'000'000'000'061ULL,
+                                     1'000'000'000'063ULL}));
+    EXPECT_EQ(firstKPrimes(10'000).back(), 104'729u);
+
+    // Far from zero the proven bounds are loose; the table grows instead. Its
+    // memory is then mostly the ~1.9M sieving primes up to sqrt(1e15).
+    EXPECT_LT(PrimeNumberGen::forFirstKPrimes(1, 1'000'000'000'000'000ULL)
+                  ->memoryBytes(),
+              32'000'000u);
+    for (uint64_t minValue : {1'000'000'000'000'000ULL,
+                              100'000'000'000'000'000ULL}) {
+        const auto primes = firstKPrimes(3, minValue);
+        ASSERT_EQ(primes.size(), 3u);
+        for (uint64_t n = minValue; n <= primes.back(); ++n) {
+            ASSERT_EQ(isPrimeMillerRabin(n),
+                      std::find(primes.begin(), primes.end(), n) != primes.end())
+                << n;
+        }
+    }
+    const auto far = firstKPrimes(100'000, 1'000'000'000'000ULL);
+    EXPECT_TRUE(std::binary_search(far.begin(), far.end(),
+                                   1'000'000'027'681ULL));
+    EXPECT_EQ(countPrimes(far.back()) - countPrimes(999'999'999'999ULL),
+              100'000u);
+}
+
+TEST(PrimeNumberGenTest, LargeSievingPrimesGoThroughBuckets) {
+    // Sieving primes up to ~3.2e6, most of them far beyond a segment, and
+    // several segments per worker.
+    const uint64_t low = 10'000'000'000'000ULL, high = low + 3'000'000;
+    for (int numThreads : {1, 3}) {
+        PrimeNumberGen pg(low, high, numThreads);
+        for (uint64_t n = low; n <= high; ++n) {
+            ASSERT_EQ(pg.isPrime(n), isPrimeMillerRabin(n)) << n;
+        }
+    }
+}
+
+TEST(PrimeNumberGenTest, BucketPrimesStartAtTheirSquare) {
+    // The squares of the primes in [264575, 265140], all above 2^18, fall in
+    // this window, far beyond the ring of buckets at its start.
+    const uint64_t low = 70'000'000'000ULL, high = low + 100'000'000;
+    for (int numThreads : {1, 3}) {
+        PrimeNumberGen pg(low, high, numThreads);
+        EXPECT_EQ(pg.pi(high), countPrimes(high) - countPrimes(low - 1));
+        EXPECT_TRUE(pg.isPrime(70'000'074'961ULL));
+        for (uint64_t p = 264'575; p <= 265'140; ++p) {
+            if (isPrimeMillerRabin(p)) {
+                ASSERT_FALSE(pg.isPrime(p * p)) << p;
+            }
+        }
+    }
+    PrimeNumberGen pg(1'000'000'000'000ULL, 1'001'000'000'000ULL);
+    EXPECT_TRUE(pg.isPrime(1'000'000'125'001ULL));
+    EXPECT_EQ(pg.pi(1'001'000'000'000ULL),
+              countPrimes(1'001'000'000'000ULL) -
+                  countPrimes(999'999'999'999ULL));
+}
+
+TEST(PrimeNumberGenTest, PrimeStream) {
+    PrimeNumberGen pg(1, 20'000'000);
+    PrimeStream stream;
+    for (auto p : pg) {
+        ASSERT_EQ(stream.next(), p);
+    }
+    EXPECT_EQ(stream.next(), 20'000'003u);
+
+    for (uint64_t from : {3ULL, 6ULL, 7ULL, 8ULL, 31ULL, 999'999ULL}) {
+        PrimeStream s(from);
+        PrimeNumberGen window(from, from + 1'000);
+        for (auto p : window) {
+            ASSERT_EQ(s.next(), p) << from;
+        }
+    }
+
+    PrimeStream window(1'000'000);
+    int count = 0;
+    while (window.next() <= 10'000'000) {
+        count++;
+    }
+    EXPECT_EQ(count, 586'081);
+
+    PrimeStream far(1'000'000'000'000ULL);
+    EXPECT_EQ(far.next(), 1'000'000'000'039ULL);
+    EXPECT_EQ(far.next(), 1'000'000'000'061ULL);
+}
+
+TEST(PrimeListTest, MatchesVector) {
+    PrimeNumberGen pg(1, 2'000'000);
+    const auto primes = pg.toVector();
+    PrimeList list(pg);
+    ASSERT_EQ(list.size(), primes.size());
+    EXPECT_EQ(list.back(), primes.back());
+    EXPECT_EQ(std::vector<uint64_t>(list.begin(), list.end()), primes);
+    for (size_t i = 0; i < primes.size(); i += 37) {
+        ASSERT_EQ(list[i], primes[i]) << i;
+    }
+    // Close to one byte per prime.
+    EXPECT_LT(list.memoryBytes(), primes.size() * 3 / 2);
+
+    // The 2 -> 3 gap and gaps above 510 are escaped.
+    const std::vector<uint64_t> sparse = {2, 3, 5, 1'000'003, 1'000'033,
+                                          10'000'000'000'037ULL};
+    PrimeList escaped(sparse);
+    EXPECT_EQ(std::vector<uint64_t>(escaped.begin(), escaped.end()), sparse);
+    EXPECT_EQ(escaped[4], 1'000'033u);
+    EXPECT_TRUE(PrimeList().empty());
 }
-BENCHMARK(BM_PrimeGenConstructionLarge)->Unit(benchmark::kMillisecond);
 
 int main(int argc, char** argv) {
     testing::InitGoogleTest(&argc, argv);
-    int ret = RUN_ALL_TESTS();
-    
-    if (ret == 0) {
-        benchmark::Initialize(&argc, argv);
-        benchmark::RunSpecifiedBenchmarks();
-    }
-    return ret;
+    return RUN_ALL_TESTS();
 }
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+
+// Prime tables for bounds known at compile time. The compiler runs the sieve,
+// so the tables cost nothing at startup and live in read-only data:
+//   static_assert(kSmallPrimeSieve<1000>.isPrime(997));
+//   for (uint32_t p : kSmallPrimes<1000>) ...
+// A bound of 1e6 adds a few seconds of compile time. Much larger ones run into
+// the compiler's constexpr operation limit; use PrimeNumberGen for those.
+
+// The primes below N as a packed bitset of the odd numbers.
+template <uint64_t N>
+class SmallPrimeSieve {
+public:
+  static constexpr uint64_t kLimit = N;
+  // Bit k % 64 of word k / 64 stands for 2k + 1.
+  static constexpr size_t kWords = (N + 127) / 128;
+
+  constexpr SmallPrimeSieve() {
+    // Multiples of the odd primes below 64 are stamped a word at a time: the
+    // bits k = (p - 1) / 2 mod p repeat every p bits.
+    for (uint64_t p = 3; p < 64 && p * p < N; p += 2) {
+      if ((p % 3 == 0 && p > 3) || (p % 5 == 0 && p > 5) ||
+          (p % 7 == 0 && p > 7)) {
+        continue;
+      }
+      uint64_t pattern = 0;
+      for (uint64_t k = 0; k < 64; k += p) {
+        pattern |= uint64_t(1) << k;
+      }
+      uint64_t offset = (p - 1) / 2; // Of the first multiple in the word.
+      for (size_t w = 0; w < kWords; ++w) {
+        bits_[w] |= pattern << offset;
+        offset = (offset + p - 64 % p) % p;
+      }
+      // p itself is prime.
+      bits_[0] &= ~(uint64_t(1) << (p - 1) / 2);
+    }
+    // Larger primes cross off their odd multiples from p^2 bit by bit. Set
+    // bits mean composite until the flip below. The loop is split so that no
+    // single constexpr loop runs for more than 2^16 iterations (GCC stops at
+    // -fconstexpr-loop-limit).
+    for (uint64_t p = 67; p * p < N; p += 2) {
+      if (((bits_[p / 128] >> (p / 2 % 64)) & 1) == 0) {
+        for (uint64_t k = p * p / 2; k < N / 2;) {
+          for (int i = 0; i < (1 << 16) && k < N / 2; ++i, k += p) {
+            bits_[k / 64] |= uint64_t(1) << (k % 64);
+          }
+        }
+      }
+    }
+    // Flip to set bits for primes. 1 is not prime, and the bits at or beyond
+    // N are padding.
+    for (size_t w = 0; w < kWords; ++w) {
+      bits_[w] = ~bits_[w];
+    }
+    bits_[0] &= ~uint64_t(1);
+    for (uint64_t k = N / 2; k < kWords * 64; ++k) {
+      bits_[k / 64] &= ~(uint64_t(1) << (k % 64));
+    }
+  }
+
+  // n must be below N.
+  constexpr bool isPrime(uint64_t n) const {
+    return n % 2 == 0 ? n == 2 : (bits_[n / 128] >> (n / 2 % 64)) & 1;
+  }
+  // The number of primes below N.
+  constexpr size_t count() const {
+    size_t count = N > 2;
+    for (uint64_t word : bits_) {
+      count += std::popcount(word);
+    }
+    return count;
+  }
+  constexpr const std::array<uint64_t, kWords>& oddPrimeBits() const {
+    return bits_;
+  }
+
+private:
+  std::array<uint64_t, kWords> bits_{};
+};
+
+template <uint64_t N>
+inline constexpr SmallPrimeSieve<N> kSmallPrimeSieve{};
+
+// The primes below N in increasing order.
+template <uint64_t N>
+inline constexpr auto kSmallPrimes = [] {
+  static_assert(N <= (uint64_t(1) << 32), "The primes are stored as uint32_t");
+  constexpr const auto& sieve = kSmallPrimeSieve<N>;
+  std::array<uint32_t, sieve.count()> primes{};
+  size_t i = 0;
+  if (N > 2) {
+    primes[i++] = 2;
+  }
+  const auto& bits = sieve.oddPrimeBits();
+  for (size_t w = 0; w < bits.size(); ++w) {
+    for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+      primes[i++] = (w * 64 + std::countr_zero(word)) * 2 + 1;
+    }
+  }
+  return primes;
+}();